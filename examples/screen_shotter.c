@@ -196,11 +196,7 @@ void carve_randomly(struct drunkard *drunk)
     else
         tile = DIRT_FLOOR;
 
-    while (!drunkard_is_on_opened(drunk))
-    {
-        drunkard_mark_plus(drunk, tile);
-        drunkard_step_to_target(drunk, 0.51);
-    }
+    drunkard_walk_to_opened(drunk, 0.51, DRUNKARD_BRUSH_PLUS, tile, ~0u, NULL);
 
     drunkard_flush_marks(drunk);
 }
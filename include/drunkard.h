@@ -38,7 +38,28 @@ Drunkard.
 
 struct drunkard;
 
+/* Cells x0 to x1 (inclusive) of row y. */
+struct drunkard_span
+{
+    int y;
+    int x0, x1;
+};
+
+/* Width of one element of the tile buffer. DRUNKARD_TILE_32 is the unsigned
+ * buffer drunkard_create takes. Tiles passed to the drunkard are truncated to
+ * this width before they're compared or stored. drunkard_create_sized returns
+ * NULL for any other width.
+ */
+enum drunkard_tile_size
+{
+    DRUNKARD_TILE_8 = 1,
+    DRUNKARD_TILE_16 = 2,
+    DRUNKARD_TILE_32 = 4
+};
+
 struct drunkard *drunkard_create(unsigned *tiles, unsigned w, unsigned h);
+struct drunkard *drunkard_create_sized(void *tiles, unsigned w, unsigned h,
+    enum drunkard_tile_size size);
 void drunkard_destroy(struct drunkard *drunk);
 
 /* Core functions. */
@@ -50,12 +71,26 @@ void drunkard_mark(struct drunkard *drunk, int x, int y, unsigned tile);
 void drunkard_flush_marks(struct drunkard *drunk);
 void drunkard_set_border(struct drunkard *drunk, bool yes);
 
+/* Chebyshev distance from x, y to the nearest opened cell or cell out of
+ * bounds, 0 if x, y is either. With the distance field on this is a lookup
+ * into a field kept up to date by each flush; without it, a search. Turning
+ * the field on allocates two map sized buffers and can fail.
+ */
+bool drunkard_set_distance_field(struct drunkard *drunk, bool yes);
+unsigned drunkard_distance_to_opened(struct drunkard *drunk, int x, int y);
+
 /* Query the drunkard. */
 
 unsigned drunkard_count_opened(struct drunkard *drunk);
 double drunkard_percent_opened(struct drunkard *drunk);
 void drunkard_random_opened(struct drunkard *drunk, unsigned *x, unsigned *y);
 
+/* Picks a random position where drunkard_is_opened_on_rect(hw, hh) would be
+ * false, each equally likely. Returns false if there is none.
+ */
+bool drunkard_random_free_rect(struct drunkard *drunk, unsigned hw, unsigned hh,
+    unsigned *x, unsigned *y);
+
 int drunkard_get_x(struct drunkard *drunk);
 int drunkard_get_y(struct drunkard *drunk);
 int drunkard_get_target_x(struct drunkard *drunk);
@@ -65,13 +100,49 @@ int drunkard_get_dy_to_target(struct drunkard *drunk);
 
 /* RNG */
 
+/* The CMWC generator is the default. xoshiro256** keeps 32 bytes of generator
+ * state instead of 16KiB, which makes lots of drunkards and reseeding cheap.
+ * Every generator also has a 1KiB buffer of output on top of that.
+ * xoshiro256** x4 runs four of those side by side, vectorized when SSE2 or
+ * AVX2 is available, for the highest throughput.
+ */
+enum drunkard_rng
+{
+    DRUNKARD_RNG_CMWC,
+    DRUNKARD_RNG_XOSHIRO256,
+    DRUNKARD_RNG_XOSHIRO256X4
+};
+
+/* Switches generators and reseeds with the current seed. */
+bool drunkard_set_rng(struct drunkard *drunk, enum drunkard_rng type);
 unsigned drunkard_get_seed(struct drunkard *drunk);
+unsigned drunkard_get_stream(struct drunkard *drunk);
 void drunkard_seed(struct drunkard *drunk, unsigned s);
+/* Every stream of a seed is a reproducible sequence, so work can be split
+ * across drunkards (and threads) by index instead of by arithmetic on seeds.
+ * Stream 0 is the same as drunkard_seed. With the xoshiro256** generators,
+ * stream k is stream 0 jumped ahead by k * 2^128 steps, so streams never
+ * overlap. CMWC streams are only seeded differently.
+ */
+void drunkard_seed_stream(struct drunkard *drunk, unsigned s, unsigned stream);
+/* Gives child the parent's generator, seeded on the parent's seed at stream. */
+bool drunkard_fork(struct drunkard *child, struct drunkard *parent,
+    unsigned stream);
 double drunkard_rng_uniform(struct drunkard *drunk);
 double drunkard_rng_under(struct drunkard *drunk, unsigned limit);
 int drunkard_rng_range(struct drunkard *drunk, int low, int high);
 bool drunkard_rng_chance(struct drunkard *drunk, double d);
 
+/* Snapshots. A snapshot holds the RNG state, position, target and path, but
+ * not the map, so a run can be resumed from it on a copy of the map taken at
+ * the same time. drunkard_state_size bytes are written to buf; while a cost
+ * path is being walked that includes the cells left on it.
+ */
+
+unsigned drunkard_state_size(struct drunkard *drunk);
+void drunkard_save_state(struct drunkard *drunk, void *buf);
+bool drunkard_load_state(struct drunkard *drunk, const void *buf);
+
 /******************************************************************************\
 Start functions.
 \******************************************************************************/
@@ -91,6 +162,11 @@ void drunkard_start_random_westeast_edge(struct drunkard *drunk);
 void drunkard_start_random_northsouth_edge(struct drunkard *drunk);
 void drunkard_start_random_edge(struct drunkard *drunk);
 void drunkard_start_random_opened(struct drunkard *drunk);
+/* Starts on a random opened tile in x0..x1 by y0..y1, or returns false and
+ * stays put if there is none.
+ */
+bool drunkard_start_random_opened_on_rect(struct drunkard *drunk,
+    int x0, int y0, int x1, int y1);
 
 /******************************************************************************\
 Targetting Functions.
@@ -111,6 +187,14 @@ void drunkard_target_random_westeast_edge(struct drunkard *drunk);
 void drunkard_target_random_northsouth_edge(struct drunkard *drunk);
 void drunkard_target_random_edge(struct drunkard *drunk);
 void drunkard_target_random_opened(struct drunkard *drunk);
+/* Targets the opened tile nearest the drunkard, by Chebyshev distance and
+ * picked at random among ties, or one at random within r of it. Both leave
+ * the target alone and return false when there is none.
+ */
+bool drunkard_target_nearest_opened(struct drunkard *drunk);
+bool drunkard_target_random_opened_within(struct drunkard *drunk, unsigned r);
+bool drunkard_target_random_opened_on_rect(struct drunkard *drunk,
+    int x0, int y0, int x1, int y1);
 
 /******************************************************************************\
 Mark functions.
@@ -123,6 +207,12 @@ void drunkard_mark_x(struct drunkard *drunk, unsigned tile);
 void drunkard_mark_rect(struct drunkard *drunk, int hw, int hh, unsigned tile);
 void drunkard_mark_circle(struct drunkard *drunk, int r, unsigned tile);
 
+/* Marks x0..x1 of row y, clipped to the bounds. */
+void drunkard_mark_span(struct drunkard *drunk, int y, int x0, int x1,
+    unsigned tile);
+void drunkard_mark_spans(struct drunkard *drunk,
+    const struct drunkard_span *spans, unsigned n, unsigned tile);
+
 /******************************************************************************\
 Step functions.
 \******************************************************************************/
@@ -131,10 +221,84 @@ void drunkard_step_by(struct drunkard *drunk, int dx, int dy);
 void drunkard_step_random(struct drunkard *drunk);
 void drunkard_step_to_target(struct drunkard *drunk, double weight);
 
+/* Weighted steps over other neighborhoods. 0.5 is an even spread and 1
+ * always steps towards the target, splitting evenly between the steps that
+ * head that way; in between, the chance of heading towards it rises
+ * linearly. That matches drunkard_step_to_target for a diagonal target, but
+ * for a target straight along a row or column the four direction walk only
+ * heads at it half the time at weight 1. _8 adds the diagonals, and returns
+ * false if its steps couldn't be allocated. _custom uses the steps given to
+ * drunkard_set_neighborhood (at most DRUNKARD_NEIGHBORHOOD_MAX).
+ */
+enum {DRUNKARD_NEIGHBORHOOD_MAX = 16};
+
+bool drunkard_step_to_target_8(struct drunkard *drunk, double weight);
+bool drunkard_set_neighborhood(struct drunkard *drunk, const int (*dirs)[2],
+    unsigned n);
+void drunkard_step_to_target_custom(struct drunkard *drunk, double weight);
+
+enum drunkard_brush
+{
+    DRUNKARD_BRUSH_1,
+    DRUNKARD_BRUSH_PLUS,
+    DRUNKARD_BRUSH_X
+};
+
+/* Marks brush and steps to target until the drunkard is on an opened tile or
+ * max_steps steps were taken. Returns the number of steps; carved, if not
+ * NULL, gets the number of cells marked.
+ */
+unsigned drunkard_walk_to_opened(struct drunkard *drunk, double weight,
+    enum drunkard_brush brush, unsigned tile, unsigned max_steps,
+    unsigned *carved);
+
 void drunkard_line_path_to_target(struct drunkard *drunk);
 void drunkard_tunnel_path_to_target(struct drunkard *drunk);
+/* Cheapest four directional path to the target. Entering a cell costs
+ * costs[y * w + x], or for the tile version costs[tile] by the tile on it
+ * (tiles from ntiles up count as 0); 0 can't be entered. With stop_at_opened
+ * the path ends at the first opened tile reached if that's sooner. Returns
+ * false, leaving the current path alone, if there's no way through. The
+ * search space is kept by the drunkard, so only the first call allocates.
+ */
+bool drunkard_cost_path_to_target(struct drunkard *drunk,
+    const unsigned *costs, bool stop_at_opened);
+bool drunkard_tile_cost_path_to_target(struct drunkard *drunk,
+    const unsigned *costs, unsigned ntiles, bool stop_at_opened);
 bool drunkard_walk_path(struct drunkard *drunk);
 void drunkard_cancel_path(struct drunkard *drunk);
+/* Walks the path the way looping drunkard_walk_path until
+ * drunkard_is_on_opened does, and stores the cells walked as spans instead
+ * of stopping at each one. Returns the number of spans stored; if that's
+ * max_spans the path may not be done, so call again for the rest. Stopping
+ * on an opened tile cancels the path, so that call returns 0 if the buffer
+ * filled up exactly there.
+ */
+unsigned drunkard_walk_path_spans(struct drunkard *drunk,
+    struct drunkard_span *spans, unsigned max_spans);
+
+/******************************************************************************\
+Walker pools.
+\******************************************************************************/
+
+/* A pool walks many walkers over the drunkard's map in lockstep. Their steps
+ * come from a generator seeded from the drunkard's RNG when they're started,
+ * and their marks merge as usual when the drunkard is flushed. A pool of
+ * size 0 is valid and never walks.
+ */
+struct drunkard_pool;
+
+struct drunkard_pool *drunkard_pool_create(struct drunkard *drunk, unsigned size);
+void drunkard_pool_destroy(struct drunkard_pool *pool);
+
+/* Starts every walker randomly and targets a random opened tile for each. */
+void drunkard_pool_start_random(struct drunkard_pool *pool);
+/* The pool version of drunkard_walk_to_opened. Returns how many walkers
+ * reached an opened tile; the rest carry on from where they are if called
+ * again.
+ */
+unsigned drunkard_pool_walk_to_opened(struct drunkard_pool *pool, double weight,
+    enum drunkard_brush brush, unsigned tile, unsigned max_steps);
 
 /******************************************************************************\
 Checking functions.
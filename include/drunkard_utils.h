@@ -37,7 +37,10 @@ extern "C" {
 /******************************************************************************\
 \******************************************************************************/
 
-typedef void drunkard_pattern_func(struct drunkard *drunk, void *args);
+/* Returns false once the pattern can't carve anything more on this map, and
+ * drunkard_carve_plans stops picking it. A plan stops when none are left.
+ */
+typedef bool drunkard_pattern_func(struct drunkard *drunk, void *args);
 
 struct drunkard_pattern
 {
@@ -45,6 +48,7 @@ struct drunkard_pattern
     drunkard_pattern_func *pattern_func;
     void *args;
     unsigned weight;
+    bool done;
 };
 
 struct drunkard_plans
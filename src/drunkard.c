@@ -37,38 +37,266 @@
 #include <string.h>
 #include <time.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "drunkard.h"
 
 /******************************************************************************\
 RNG.
 \******************************************************************************/
 
-/* Medium speed. High memory. Period ~= 2^131104. */
+/* CMWC: Medium speed. High memory. Period ~= 2^131104.
+ * xoshiro256**: Fast. 32 bytes of state. Period 2^256 - 1.
+ * xoshiro256** x4: Four interleaved xoshiro256** lanes, stepped together with
+ * SSE2 or AVX2 when available. The output doesn't depend on which is used.
+ *
+ * Any of them is seeded by expanding the seed through splitmix64, which keeps
+ * seeding reentrant and the output the same on every libc. xoshiro256**
+ * stream k starts where stream 0 would be after k * 2^128 steps, so streams
+ * can't overlap until one has drawn 2^128 numbers. The four x4 lanes are
+ * 2^192 steps apart before the stream is applied. CMWC has no cheap jump
+ * ahead, so its streams are only seeded differently: the stream goes above
+ * the seed in the key splitmix64 expands, and the carry ignores it.
+ *
+ * Output is generated RNG_BUFFER numbers at a time and handed out from buf.
+ * The state the buffer was generated from is kept alongside, so saving only
+ * needs that and pos: loading refills the buffer from it.
+ */
 enum {CMWC_K = 4096};
+enum {RNG_BUFFER = 256, RNG_LANES = 4};
 struct rng_state
 {
-    uint32_t q[CMWC_K];
+    enum drunkard_rng type;
+
+    uint32_t *q;
     uint32_t c;
     uint32_t i;
+
+    uint64_t s[4];
+    /* lanes[k][l] is state word k of lane l. */
+    uint64_t lanes[4][RNG_LANES];
+
+    uint32_t buf[RNG_BUFFER];
+    unsigned pos;
+
+    /* The state before buf was last filled. CMWC keeps the q entries the
+     * fill overwrote rather than all of q, in the same allocation as q.
+     */
+    uint32_t base_c;
+    uint32_t base_i;
+    uint32_t *base_q;
+    uint64_t base_s[4];
+    uint64_t base_lanes[4][RNG_LANES];
+};
+
+#define ROTL64(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* xoshiro_jumps[i] advances xoshiro256** by 2^(128 + i) steps, as a
+ * polynomial in the step: bit b of word w is the coefficient of step
+ * 64 * w + b. [0] is the reference jump().
+ */
+static const uint64_t xoshiro_jumps[32][4] =
+{
+    {0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+     0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL},
+    {0x8cfe9bd9ab71d992ULL, 0xccfc8ca2814de79eULL,
+     0xa5a28cccb37dba5bULL, 0xa23e49ee6f1a7a8dULL},
+    {0x1b2a94a672a48c05ULL, 0x5e38f4fbb6fcda72ULL,
+     0xca8a45310219dc67ULL, 0xd4e9921bccb8090bULL},
+    {0xf30974a2b1dbbb71ULL, 0x34cd4cc8228d74acULL,
+     0xfa0587a90f717438ULL, 0xee658f69deb5df26ULL},
+    {0xb42bd4670583b289ULL, 0xd2c0d8e0c8a2fb9bULL,
+     0x2573e3218d8bb7daULL, 0xd7aaaf48aa459c58ULL},
+    {0xf6a5ab84efb67883ULL, 0xcc7efdcfed1ac303ULL,
+     0xd82be75b83dbc2d0ULL, 0x8fd437c01abeab24ULL},
+    {0xc85ee5171484f5a4ULL, 0xedc8b8d02a22310bULL,
+     0xb0b87a330b854c8aULL, 0x7d16742eceb4d5abULL},
+    {0x4298ba0e862a6007ULL, 0x4157dc48443e3565ULL,
+     0x13c97c0891cab48aULL, 0x6533981804b420eaULL},
+    {0xee5f5a6f02dfe47cULL, 0xedc28c89cb341660ULL,
+     0x613b2ed9f0acc107ULL, 0xa1ee335d14807ae0ULL},
+    {0x5ec3050c6b43565aULL, 0x4b26f71c1fb1b47bULL,
+     0x0531513e8e0ac706ULL, 0x799d469b2145a8a3ULL},
+    {0x34f0a6799020283eULL, 0x7123f2290a1f413bULL,
+     0xb6acd7be4906b73dULL, 0x6007bb31ec5a2964ULL},
+    {0xaa0711c54877febdULL, 0x54fe6df4cff0db73ULL,
+     0x7e42d6f544840499ULL, 0xec907801890a47abULL},
+    {0x03833e601d82a673ULL, 0x3ec263f5c999196eULL,
+     0xd8c4367e574ab160ULL, 0x964e9d188c16508eULL},
+    {0xd64f3f2aaf8f2171ULL, 0xf524fd4408357a5cULL,
+     0x15ac212f3b861b5aULL, 0x24d9ba21277dd8d8ULL},
+    {0xfe9b778d7d1ca2deULL, 0xbbe0e2c0c44b2e1cULL,
+     0x17a7af3e97d8c402ULL, 0xf89354cfe1e6b5fbULL},
+    {0x695cf225704e767dULL, 0xf4873d277cd1ab72ULL,
+     0xaad8c318bc459cceULL, 0xb89526857566cd94ULL},
+    {0x3dcd32f39276a95fULL, 0xc51212c8b1aa2787ULL,
+     0x962c90a866ea6719ULL, 0xb81875d0f4f6f253ULL},
+    {0xb43cf8e4eaf8e068ULL, 0x1c554e97b2277f47ULL,
+     0xa5a140826c351d07ULL, 0x11495a1b200d4eb8ULL},
+    {0x417b73b324735d32ULL, 0xff957b6f55288048ULL,
+     0x05af69bf1fb82891ULL, 0x3e53bfa0db28e110ULL},
+    {0xb6c7a6004612889cULL, 0xfdb3f4ea18f0a56bULL,
+     0xd3da65e82bdd39e2ULL, 0x48f6214560239b46ULL},
+    {0xf1267ba0ec3c645eULL, 0xd9dc0929a54fea75ULL,
+     0xec60b640d685171dULL, 0xde364ef64a484f59ULL},
+    {0x2761cbab38e0f580ULL, 0xd7f1c5ade3de404aULL,
+     0xcb6286958a9af01aULL, 0x2b29c7d3ef18d3b3ULL},
+    {0x5a5ce93f67a3cdd6ULL, 0x547db3576511edc2ULL,
+     0x99455c744595c01fULL, 0x6a3b6a431109e3d1ULL},
+    {0xafd80c1c832a739eULL, 0x0d9d73da9f40f374ULL,
+     0xed1d0a619aa60748ULL, 0x00d2333b0c03f620ULL},
+    {0x11428ceb13f2cc2cULL, 0xef46e42368baead3ULL,
+     0x2a47bd3fc39081daULL, 0x3f03458e0273439bULL},
+    {0x47558e815c898e8bULL, 0x9f8160e9d0124398ULL,
+     0x0fdcfd4ab0f5afeeULL, 0xade2626c292a2a9fULL},
+    {0xe848ff06d72a9252ULL, 0xf8be2d3d6ce206b0ULL,
+     0xd84fc5f798c1a55eULL, 0xc35abe5cebab1ba4ULL},
+    {0xb0dd0edb19af078cULL, 0xee1d857a675ca074ULL,
+     0x60ef7116e6f3c1e0ULL, 0x7c25b2c3282fb730ULL},
+    {0xb51a19064886308aULL, 0x6b590805d407e77eULL,
+     0x57059d3707ee283aULL, 0x6298f48fa13cc12fULL},
+    {0x4f1102acb29c3230ULL, 0xcf69cee6182fa164ULL,
+     0x1780be415c86b5d5ULL, 0xab5d0760d1fe77dcULL},
+    {0xc639b7c24b26ef11ULL, 0xa57d650a8007d505ULL,
+     0xd81275131f4f91f8ULL, 0x10000e5f7bf7a58bULL},
+    {0x295b23eaa04478edULL, 0xf1d3279f36823213ULL,
+     0x743eedc2ede6d478ULL, 0x09d89163f581d1e0ULL}
+};
+
+static const uint64_t xoshiro_long_jump[4] =
+{
+    0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL,
+    0x77710069854ee241ULL, 0x39109bb02acbe635ULL
 };
 
-void rng_seed(struct rng_state *st, uint32_t seed)
+static uint64_t xoshiro_u64(uint64_t *s)
+{
+    uint64_t result = ROTL64(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = ROTL64(s[3], 45);
+
+    return result;
+}
+
+/* Advances s by the steps poly stands for. */
+static void xoshiro_jump(uint64_t *s, const uint64_t *poly)
+{
+    uint64_t t[4] = {0, 0, 0, 0};
+    int i, b;
+
+    for (i = 0; i < 4; ++i)
+    {
+        for (b = 0; b < 64; ++b)
+        {
+            if (poly[i] & (uint64_t)1 << b)
+            {
+                t[0] ^= s[0];
+                t[1] ^= s[1];
+                t[2] ^= s[2];
+                t[3] ^= s[3];
+            }
+            xoshiro_u64(s);
+        }
+    }
+
+    memcpy(s, t, sizeof t);
+}
+
+/* jump() applied stream times, one table jump per set bit. */
+static void xoshiro_stream(uint64_t *s, uint32_t stream)
 {
     int i;
-    srand(seed);
-    for (i = 0; i < CMWC_K; ++i)
+
+    for (i = 0; stream; ++i, stream >>= 1)
+        if (stream & 1)
+            xoshiro_jump(s, xoshiro_jumps[i]);
+}
+
+bool rng_init(struct rng_state *st, enum drunkard_rng type)
+{
+    memset(st, 0, sizeof *st);
+    st->type = type;
+
+    if (type == DRUNKARD_RNG_CMWC)
     {
-        st->q[i] = rand();
+        st->q = malloc(sizeof *st->q * (CMWC_K + RNG_BUFFER));
+        if (!st->q)
+            return false;
+        st->base_q = st->q + CMWC_K;
     }
-    st->c = (seed < 809430660) ? seed : 809430660 - 1;
-    st->i = CMWC_K - 1;
+
+    return true;
 }
 
-uint32_t rng_u32(struct rng_state *st)
+void rng_uninit(struct rng_state *st)
+{
+    free(st->q);
+}
+
+void rng_seed(struct rng_state *st, uint32_t seed, uint32_t stream)
+{
+    int i, l;
+    uint64_t x = seed;
+
+    if (st->type == DRUNKARD_RNG_CMWC)
+    {
+        x |= (uint64_t)stream << 32;
+        for (i = 0; i < CMWC_K; ++i)
+        {
+            st->q[i] = splitmix64(&x) >> 32;
+        }
+        st->c = (seed < 809430660) ? seed : 809430660 - 1;
+        st->i = CMWC_K - 1;
+    }
+    else if (st->type == DRUNKARD_RNG_XOSHIRO256)
+    {
+        /* splitmix64 never outputs four zeros in a row. */
+        for (i = 0; i < 4; ++i)
+            st->s[i] = splitmix64(&x);
+        xoshiro_stream(st->s, stream);
+    }
+    else
+    {
+        uint64_t s[4];
+
+        for (i = 0; i < 4; ++i)
+            s[i] = splitmix64(&x);
+        xoshiro_stream(s, stream);
+        for (l = 0; l < RNG_LANES; ++l)
+        {
+            if (l)
+                xoshiro_jump(s, xoshiro_long_jump);
+            for (i = 0; i < 4; ++i)
+                st->lanes[i][l] = s[i];
+        }
+    }
+
+    st->pos = RNG_BUFFER;
+}
+
+static uint32_t cmwc_u32(struct rng_state *st)
 {
     uint32_t a = 18782;
     uint32_t r = 0xfffffffe;
-    uint32_t q, ql, qh, gl, tl, th;
+    uint32_t q, ql, qh, tl, th;
     uint32_t x;
 
     st->i = (st->i + 1) & (CMWC_K - 1);
@@ -92,6 +320,234 @@ uint32_t rng_u32(struct rng_state *st)
     return st->q[st->i] = r - x;
 }
 
+/* Steps all lanes once. Each lane's 64 bit output is stored low half first,
+ * lane after lane.
+ */
+#if defined(__AVX2__)
+#define ROTL64X4(x, k) \
+    _mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - (k)))
+
+static void xoshiro_x4_step(uint64_t (*lanes)[RNG_LANES], uint32_t *out)
+{
+    __m256i s0 = _mm256_loadu_si256((__m256i *)lanes[0]);
+    __m256i s1 = _mm256_loadu_si256((__m256i *)lanes[1]);
+    __m256i s2 = _mm256_loadu_si256((__m256i *)lanes[2]);
+    __m256i s3 = _mm256_loadu_si256((__m256i *)lanes[3]);
+    __m256i r, t;
+
+    /* rotl(s1 * 5, 7) * 9, with the multiplies as shifts and adds. */
+    r = _mm256_add_epi64(_mm256_slli_epi64(s1, 2), s1);
+    r = ROTL64X4(r, 7);
+    r = _mm256_add_epi64(_mm256_slli_epi64(r, 3), r);
+    _mm256_storeu_si256((__m256i *)out, r);
+
+    t = _mm256_slli_epi64(s1, 17);
+    s2 = _mm256_xor_si256(s2, s0);
+    s3 = _mm256_xor_si256(s3, s1);
+    s1 = _mm256_xor_si256(s1, s2);
+    s0 = _mm256_xor_si256(s0, s3);
+    s2 = _mm256_xor_si256(s2, t);
+    s3 = ROTL64X4(s3, 45);
+
+    _mm256_storeu_si256((__m256i *)lanes[0], s0);
+    _mm256_storeu_si256((__m256i *)lanes[1], s1);
+    _mm256_storeu_si256((__m256i *)lanes[2], s2);
+    _mm256_storeu_si256((__m256i *)lanes[3], s3);
+}
+#elif defined(__SSE2__)
+#define ROTL64X2(x, k) \
+    _mm_or_si128(_mm_slli_epi64(x, k), _mm_srli_epi64(x, 64 - (k)))
+
+static void xoshiro_x4_step(uint64_t (*lanes)[RNG_LANES], uint32_t *out)
+{
+    int l;
+    __m128i s0, s1, s2, s3, r, t;
+
+    for (l = 0; l < RNG_LANES; l += 2)
+    {
+        s0 = _mm_loadu_si128((__m128i *)&lanes[0][l]);
+        s1 = _mm_loadu_si128((__m128i *)&lanes[1][l]);
+        s2 = _mm_loadu_si128((__m128i *)&lanes[2][l]);
+        s3 = _mm_loadu_si128((__m128i *)&lanes[3][l]);
+
+        /* rotl(s1 * 5, 7) * 9, with the multiplies as shifts and adds. */
+        r = _mm_add_epi64(_mm_slli_epi64(s1, 2), s1);
+        r = ROTL64X2(r, 7);
+        r = _mm_add_epi64(_mm_slli_epi64(r, 3), r);
+        _mm_storeu_si128((__m128i *)&out[l * 2], r);
+
+        t = _mm_slli_epi64(s1, 17);
+        s2 = _mm_xor_si128(s2, s0);
+        s3 = _mm_xor_si128(s3, s1);
+        s1 = _mm_xor_si128(s1, s2);
+        s0 = _mm_xor_si128(s0, s3);
+        s2 = _mm_xor_si128(s2, t);
+        s3 = ROTL64X2(s3, 45);
+
+        _mm_storeu_si128((__m128i *)&lanes[0][l], s0);
+        _mm_storeu_si128((__m128i *)&lanes[1][l], s1);
+        _mm_storeu_si128((__m128i *)&lanes[2][l], s2);
+        _mm_storeu_si128((__m128i *)&lanes[3][l], s3);
+    }
+}
+#else
+static void xoshiro_x4_step(uint64_t (*lanes)[RNG_LANES], uint32_t *out)
+{
+    int l;
+    uint64_t s[4], r;
+
+    for (l = 0; l < RNG_LANES; ++l)
+    {
+        s[0] = lanes[0][l];
+        s[1] = lanes[1][l];
+        s[2] = lanes[2][l];
+        s[3] = lanes[3][l];
+
+        r = xoshiro_u64(s);
+        out[l * 2] = (uint32_t)r;
+        out[l * 2 + 1] = (uint32_t)(r >> 32);
+
+        lanes[0][l] = s[0];
+        lanes[1][l] = s[1];
+        lanes[2][l] = s[2];
+        lanes[3][l] = s[3];
+    }
+}
+#endif
+
+static void rng_fill(struct rng_state *st)
+{
+    unsigned i;
+    uint64_t r;
+
+    switch (st->type)
+    {
+    case DRUNKARD_RNG_CMWC:
+        st->base_c = st->c;
+        st->base_i = st->i;
+        for (i = 0; i < RNG_BUFFER; ++i)
+        {
+            st->base_q[i] = st->q[(st->i + 1) & (CMWC_K - 1)];
+            st->buf[i] = cmwc_u32(st);
+        }
+        break;
+    case DRUNKARD_RNG_XOSHIRO256:
+        memcpy(st->base_s, st->s, sizeof st->s);
+        for (i = 0; i < RNG_BUFFER; i += 2)
+        {
+            r = xoshiro_u64(st->s);
+            st->buf[i] = (uint32_t)r;
+            st->buf[i + 1] = (uint32_t)(r >> 32);
+        }
+        break;
+    default:
+        memcpy(st->base_lanes, st->lanes, sizeof st->lanes);
+        for (i = 0; i < RNG_BUFFER; i += 2 * RNG_LANES)
+            xoshiro_x4_step(st->lanes, &st->buf[i]);
+        break;
+    }
+
+    st->pos = 0;
+}
+
+uint32_t rng_u32(struct rng_state *st)
+{
+    if (st->pos == RNG_BUFFER)
+        rng_fill(st);
+    return st->buf[st->pos++];
+}
+
+/* Bytes needed to save a generator of type: its state and pos. */
+unsigned rng_state_size(enum drunkard_rng type)
+{
+    struct rng_state *st = NULL;
+    unsigned size = sizeof st->pos;
+
+    switch (type)
+    {
+    case DRUNKARD_RNG_CMWC:
+        return size + sizeof st->c + sizeof st->i + sizeof *st->q * CMWC_K;
+    case DRUNKARD_RNG_XOSHIRO256:
+        return size + sizeof st->s;
+    default:
+        return size + sizeof st->lanes;
+    }
+}
+
+#define SAVE(p, src, size) (memcpy(p, src, size), (p) += (size))
+#define LOAD(p, dst, size) (memcpy(dst, p, size), (p) += (size))
+
+/* Saves the state buf was filled from, or the current state when buf is
+ * used up and the next number comes from a fresh fill anyway.
+ */
+void rng_save(struct rng_state *st, unsigned char *p)
+{
+    bool base = st->pos < RNG_BUFFER;
+    uint32_t *q;
+    unsigned i;
+
+    SAVE(p, &st->pos, sizeof st->pos);
+
+    switch (st->type)
+    {
+    case DRUNKARD_RNG_CMWC:
+        SAVE(p, base ? &st->base_c : &st->c, sizeof st->c);
+        SAVE(p, base ? &st->base_i : &st->i, sizeof st->i);
+        q = (uint32_t *)p;
+        SAVE(p, st->q, sizeof *st->q * CMWC_K);
+        if (base)
+            for (i = 0; i < RNG_BUFFER; ++i)
+                memcpy(&q[(st->base_i + 1 + i) & (CMWC_K - 1)],
+                    &st->base_q[i], sizeof *q);
+        break;
+    case DRUNKARD_RNG_XOSHIRO256:
+        SAVE(p, base ? st->base_s : st->s, sizeof st->s);
+        break;
+    default:
+        SAVE(p, base ? st->base_lanes : st->lanes, sizeof st->lanes);
+        break;
+    }
+}
+
+/* Checks a saved pos before anything is loaded. */
+bool rng_check(const unsigned char *p)
+{
+    unsigned pos;
+
+    memcpy(&pos, p, sizeof pos);
+    return pos <= RNG_BUFFER;
+}
+
+/* st must already be of the saved type and p must pass rng_check. */
+void rng_load(struct rng_state *st, const unsigned char *p)
+{
+    unsigned pos;
+
+    LOAD(p, &pos, sizeof pos);
+
+    switch (st->type)
+    {
+    case DRUNKARD_RNG_CMWC:
+        LOAD(p, &st->c, sizeof st->c);
+        LOAD(p, &st->i, sizeof st->i);
+        LOAD(p, st->q, sizeof *st->q * CMWC_K);
+        break;
+    case DRUNKARD_RNG_XOSHIRO256:
+        LOAD(p, st->s, sizeof st->s);
+        break;
+    default:
+        LOAD(p, st->lanes, sizeof st->lanes);
+        break;
+    }
+
+    st->pos = RNG_BUFFER;
+    if (pos < RNG_BUFFER)
+    {
+        rng_fill(st);
+        st->pos = pos;
+    }
+}
+
 double rng_uniform(struct rng_state *st)
 {
     return rng_u32(st) * 2.3283064365386963e-10;
@@ -107,9 +563,33 @@ double rng_between(struct rng_state *st, int32_t min, int32_t max)
     return rng_under(st, max - min) + min;
 }
 
+/* Lemire's multiply-shift with rejection: unbiased and integer only. An empty
+ * range (max < min) gives min.
+ */
 int32_t rng_range(struct rng_state *st, int32_t min, int32_t max)
 {
-    return floor(rng_between(st, min, max + 1));
+    uint32_t span = (uint32_t)max - (uint32_t)min + 1;
+    uint32_t low, threshold;
+    uint64_t m;
+
+    if (max < min)
+        return min;
+    if (span == 0)
+        return (int32_t)rng_u32(st);
+
+    m = (uint64_t)rng_u32(st) * span;
+    low = (uint32_t)m;
+    if (low < span)
+    {
+        threshold = -span % span;
+        while (low < threshold)
+        {
+            m = (uint64_t)rng_u32(st) * span;
+            low = (uint32_t)m;
+        }
+    }
+
+    return (int32_t)((uint32_t)min + (uint32_t)(m >> 32));
 }
 
 bool rng_chance(struct rng_state *st, double ch)
@@ -117,6 +597,66 @@ bool rng_chance(struct rng_state *st, double ch)
     return rng_uniform(st) < ch;
 }
 
+/******************************************************************************\
+Bit operations.
+\******************************************************************************/
+
+#define WORD_BITS 64
+#define WORDS_FOR(n) (((n) + WORD_BITS - 1) / WORD_BITS)
+#define BIT(i) ((uint64_t)1 << ((i) & (WORD_BITS - 1)))
+
+static int bit_ctz(uint64_t w)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(w);
+#else
+    int n = 0;
+    while (!(w & 1))
+    {
+        w >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+static unsigned bit_popcount(uint64_t w)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(w);
+#else
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (w * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+/* Index of the k-th (from 0) set bit of w. */
+static int bit_select(uint64_t w, unsigned k)
+{
+    while (k--)
+        w &= w - 1;
+    return bit_ctz(w);
+}
+
+/* Index of the highest set bit of w. */
+static int bit_msb(uint64_t w)
+{
+#if defined(__GNUC__)
+    return WORD_BITS - 1 - __builtin_clzll(w);
+#else
+    int n = 0;
+    while (w >>= 1)
+        n++;
+    return n;
+#endif
+}
+
+/* Bits from and to the given bit positions, inclusive. */
+#define MASK_FROM(i) (~(uint64_t)0 << ((i) & (WORD_BITS - 1)))
+#define MASK_TO(i) (~(uint64_t)0 >> (WORD_BITS - 1 - ((i) & (WORD_BITS - 1))))
+
 /******************************************************************************\
 Point set.
 \******************************************************************************/
@@ -137,68 +677,167 @@ struct point make_point(int x, int y)
 #define INDEX1(arr, i) ((arr)[(i)])
 #define INDEX2(arr, x, y, w) INDEX1(arr, (y) * (w) + (x))
 
+/* Membership is a bitmap with each row padded out to whole 64 bit words.
+ *
+ * A ranked set also keeps a rank directory: a fenwick tree of member counts
+ * per block of RANK_BLOCK_WORDS words. That's enough to find the k-th member
+ * in O(log n), so one can be sampled at random without a list of points.
+ * An area set is ranked and also keeps a two dimensional fenwick tree of
+ * member counts per area block, one word wide and AREA_BLOCK_ROWS rows tall,
+ * so that whether a rectangle holds any member only needs the bitmap along
+ * its edges.
+ * A sparse set instead remembers which words it has touched, so that merging
+ * it into another set and clearing it only visit those words.
+ */
+enum {POINTSET_SPARSE, POINTSET_RANKED, POINTSET_AREA};
+enum {RANK_BLOCK_WORDS = 8, AREA_BLOCK_ROWS = 8};
+
 struct pointset
 {
-    struct point *arr;
+    uint64_t *bits;
+    unsigned stride;
+    unsigned words;
     unsigned length;
-
-    bool *map;
     unsigned width, height;
+
+    /* 1-based fenwick tree over blocks. */
+    unsigned *rank;
+    unsigned blocks;
+
+    /* 1-based fenwick tree over area blocks, area_height rows of
+     * area_width, stored with a zero row and column in front.
+     */
+    unsigned *area;
+    unsigned area_width, area_height;
+
+    unsigned *dirty;
+    unsigned dirty_length;
+    uint64_t *dirty_bits;
 };
 
-#define POINTSET_FOR(ps, i, p) \
-    for ((i) = 0, (p) = &(ps)->arr[(i)]; \
-         (i) < (ps)->length; \
-         (i)++, (p)++)
+#define POINTSET_WORD(ps, x, y) ((y) * (ps)->stride + (x) / WORD_BITS)
 
-bool pointset_init(struct pointset *ps, unsigned width, unsigned height)
+bool pointset_init(struct pointset *ps, unsigned width, unsigned height, int kind)
 {
+    unsigned words;
+
     memset(ps, 0, sizeof *ps);
 
-    ps->arr = malloc(sizeof *ps->arr * width * height);
-    if (!ps->arr)
-        goto alloc_failure;
-    memset(ps->arr, 0, sizeof *ps->arr * width * height);
+    ps->stride = WORDS_FOR(width);
+    words = ps->stride * height;
+    ps->words = words;
 
-    ps->map = malloc(sizeof *ps->map * width * height);
-    if (!ps->map)
+    ps->bits = calloc(words, sizeof *ps->bits);
+    if (!ps->bits)
         goto alloc_failure;
-    memset(ps->map, 0, sizeof *ps->map * width * height);
+
+    if (kind == POINTSET_RANKED || kind == POINTSET_AREA)
+    {
+        ps->blocks = (words + RANK_BLOCK_WORDS - 1) / RANK_BLOCK_WORDS;
+        ps->rank = calloc(ps->blocks + 1, sizeof *ps->rank);
+        if (!ps->rank)
+            goto alloc_failure;
+    }
+
+    if (kind == POINTSET_AREA)
+    {
+        ps->area_width = ps->stride;
+        ps->area_height = (height + AREA_BLOCK_ROWS - 1) / AREA_BLOCK_ROWS;
+        ps->area = calloc((ps->area_width + 1) * (ps->area_height + 1),
+            sizeof *ps->area);
+        if (!ps->area)
+            goto alloc_failure;
+    }
+
+    if (kind == POINTSET_SPARSE)
+    {
+        ps->dirty = malloc(sizeof *ps->dirty * words);
+        if (!ps->dirty)
+            goto alloc_failure;
+
+        ps->dirty_bits = calloc(WORDS_FOR(words), sizeof *ps->dirty_bits);
+        if (!ps->dirty_bits)
+            goto alloc_failure;
+    }
 
     ps->length = 0;
+    ps->dirty_length = 0;
     ps->width = width;
     ps->height = height;
 
     return true;
 
 alloc_failure:
-    if (ps->map)
-        free(ps->map);
-    if (ps->arr)
-        free(ps->arr);
+    free(ps->dirty_bits);
+    free(ps->dirty);
+    free(ps->area);
+    free(ps->rank);
+    free(ps->bits);
     return false;
 }
 
 void pointset_uninit(struct pointset *ps)
 {
-    free(ps->arr);
-    free(ps->map);
+    free(ps->bits);
+    free(ps->rank);
+    free(ps->area);
+    free(ps->dirty);
+    free(ps->dirty_bits);
 }
 
 bool pointset_has(struct pointset *ps, struct point p)
 {
-    if (INDEX2(ps->map, p.x, p.y, ps->width))
+    if (ps->bits[POINTSET_WORD(ps, p.x, p.y)] & BIT(p.x))
         return true;
     return false;
 }
 
+static void pointset_touch(struct pointset *ps, unsigned word)
+{
+    if (ps->dirty && !(ps->dirty_bits[word / WORD_BITS] & BIT(word)))
+    {
+        ps->dirty_bits[word / WORD_BITS] |= BIT(word);
+        ps->dirty[ps->dirty_length++] = word;
+    }
+}
+
+static void pointset_count(struct pointset *ps, unsigned word, int delta)
+{
+    unsigned i, bx, by;
+
+    ps->length += delta;
+    if (ps->rank)
+        for (i = word / RANK_BLOCK_WORDS + 1; i <= ps->blocks; i += i & -i)
+            ps->rank[i] += delta;
+    if (ps->area)
+        for (by = word / ps->stride / AREA_BLOCK_ROWS + 1;
+            by <= ps->area_height; by += by & -by)
+            for (bx = word % ps->stride + 1; bx <= ps->area_width;
+                bx += bx & -bx)
+                ps->area[by * (ps->area_width + 1) + bx] += delta;
+}
+
+/* Members in area blocks 0..bx - 1 by 0..by - 1. */
+static unsigned pointset_area_prefix(struct pointset *ps, unsigned bx,
+    unsigned by)
+{
+    unsigned i, j, sum = 0;
+
+    for (j = by; j; j -= j & -j)
+        for (i = bx; i; i -= i & -i)
+            sum += ps->area[j * (ps->area_width + 1) + i];
+    return sum;
+}
+
 bool pointset_add(struct pointset *ps, struct point p)
 {
-    if (!pointset_has(ps, p))
+    unsigned word = POINTSET_WORD(ps, p.x, p.y);
+
+    if (!(ps->bits[word] & BIT(p.x)))
     {
-        INDEX2(ps->map, p.x, p.y, ps->width) = true;
-        ps->arr[ps->length] = p;
-        ps->length++;
+        ps->bits[word] |= BIT(p.x);
+        pointset_touch(ps, word);
+        pointset_count(ps, word, 1);
         return true;
     }
 
@@ -207,100 +846,690 @@ bool pointset_add(struct pointset *ps, struct point p)
 
 bool pointset_rem(struct pointset *ps, struct point p)
 {
-    if (pointset_has(ps, p))
-    {
-        INDEX2(ps->map, p.x, p.y, ps->width) = false;
-
-        unsigned i;
-        for (i = 0; i < ps->length; ++i)
-            if (ps->arr[i].x == p.x && ps->arr[i].y == p.y)
-                break;
+    unsigned word = POINTSET_WORD(ps, p.x, p.y);
 
-        memmove(&ps->arr[i], &ps->arr[i + 1], (ps->length - i) * sizeof *ps->arr);
-        ps->length--;
+    if (ps->bits[word] & BIT(p.x))
+    {
+        ps->bits[word] &= ~BIT(p.x);
+        pointset_count(ps, word, -1);
         return true;
     }
 
     return false;
 }
 
-struct point pointset_random(struct pointset *ps, struct rng_state *rng)
+/* The k-th member in row major order. ps must be ranked. */
+struct point pointset_select(struct pointset *ps, unsigned k)
 {
-    return ps->arr[rng_range(rng, 0, ps->length - 1)];
+    unsigned block = 0, step, word, end, n;
+
+    for (step = 1; step * 2 <= ps->blocks; step *= 2)
+        ;
+    for (; step; step /= 2)
+    {
+        if (block + step <= ps->blocks && ps->rank[block + step] <= k)
+        {
+            block += step;
+            k -= ps->rank[block];
+        }
+    }
+
+    word = block * RANK_BLOCK_WORDS;
+    end = word + RANK_BLOCK_WORDS < ps->words ? word + RANK_BLOCK_WORDS : ps->words;
+    for (; word < end; ++word)
+    {
+        n = bit_popcount(ps->bits[word]);
+        if (k < n)
+            break;
+        k -= n;
+    }
+
+    return make_point((word % ps->stride) * WORD_BITS +
+        bit_select(ps->bits[word], k), word / ps->stride);
 }
 
-void pointset_clear(struct pointset *ps)
+struct point pointset_random(struct pointset *ps, struct rng_state *rng)
 {
-    ps->length = 0;
-    memset(ps->map, 0, sizeof *ps->map * ps->width * ps->height);
+    if (!ps->length)
+        return make_point(-1, -1);
+    return pointset_select(ps, rng_range(rng, 0, ps->length - 1));
 }
 
-/******************************************************************************\
-Drunkard.
-\******************************************************************************/
-
-#define STACK_SIZE 256
+/* Row versions of add and rem, for x0..x1 on row y, a word at a time. */
+void pointset_add_row(struct pointset *ps, int y, int x0, int x1)
+{
+    unsigned word, first = POINTSET_WORD(ps, x0, y), last = POINTSET_WORD(ps, x1, y);
+    uint64_t mask, added;
 
-#define TILE_AT(d, x, y) (INDEX2((d)->tiles, x, y, (d)->width))
-#define IN_BOUNDS(d, x, y) \
-    (((d)->border) ? \
-    ((x) >= 1 && (y) >= 1 && (x) < (int)(d)->width - 1 && (y) < (int)(d)->height - 1) : \
-    ((x) >= 0 && (y) >= 0 && (x) < (int)(d)->width && (y) < (int)(d)->height))
+    for (word = first; word <= last; ++word)
+    {
+        mask = ~(uint64_t)0;
+        if (word == first)
+            mask &= MASK_FROM(x0);
+        if (word == last)
+            mask &= MASK_TO(x1);
+
+        added = mask & ~ps->bits[word];
+        if (added)
+        {
+            ps->bits[word] |= added;
+            pointset_touch(ps, word);
+            pointset_count(ps, word, bit_popcount(added));
+        }
+    }
+}
 
-struct drunkard
+void pointset_rem_row(struct pointset *ps, int y, int x0, int x1)
 {
-    struct pointset *openedset;
-    struct pointset *markedset;
-    struct rng_state *rng;
-    unsigned seed;
+    unsigned word, first = POINTSET_WORD(ps, x0, y), last = POINTSET_WORD(ps, x1, y);
+    uint64_t mask, removed;
 
-    unsigned *tiles;
-    unsigned width, height;
-    unsigned open_threshold;
+    for (word = first; word <= last; ++word)
+    {
+        mask = ~(uint64_t)0;
+        if (word == first)
+            mask &= MASK_FROM(x0);
+        if (word == last)
+            mask &= MASK_TO(x1);
+
+        removed = mask & ps->bits[word];
+        if (removed)
+        {
+            ps->bits[word] &= ~removed;
+            pointset_count(ps, word, -(int)bit_popcount(removed));
+        }
+    }
+}
 
-    bool border;
-    int top;
-    int bot;
-    int left;
-    int right;
+/* The first and last member on row y within x0..x1, or -1 if there's none. */
+int pointset_first_in_row(struct pointset *ps, int y, int x0, int x1)
+{
+    unsigned word, first = POINTSET_WORD(ps, x0, y), last = POINTSET_WORD(ps, x1, y);
+    uint64_t m;
 
-    int x, y;
-    int target_x, target_y;
+    for (word = first; word <= last; ++word)
+    {
+        m = ps->bits[word];
+        if (word == first)
+            m &= MASK_FROM(x0);
+        if (word == last)
+            m &= MASK_TO(x1);
+        if (m)
+            return (word - y * ps->stride) * WORD_BITS + bit_ctz(m);
+    }
 
-    unsigned char path_data[256];
-    bool (*pathing_function) (struct drunkard *);
-};
+    return -1;
+}
 
-struct drunkard *drunkard_create(unsigned *tiles, unsigned w, unsigned h)
+int pointset_last_in_row(struct pointset *ps, int y, int x0, int x1)
 {
-    struct drunkard *drunk = malloc(sizeof *drunk);
-    if (!drunk)
-        goto alloc_failure;
+    unsigned word, first = POINTSET_WORD(ps, x0, y), last = POINTSET_WORD(ps, x1, y);
+    uint64_t m;
 
-    memset(drunk, 0, sizeof *drunk);
+    for (word = last + 1; word-- > first; )
+    {
+        m = ps->bits[word];
+        if (word == first)
+            m &= MASK_FROM(x0);
+        if (word == last)
+            m &= MASK_TO(x1);
+        if (m)
+            return (word - y * ps->stride) * WORD_BITS + bit_msb(m);
+    }
 
-    drunk->markedset = malloc(sizeof *drunk->markedset);
-    if (!drunk->markedset)
-        goto alloc_failure;
+    return -1;
+}
 
-    drunk->openedset = malloc(sizeof *drunk->openedset);
-    if (!drunk->openedset)
-        goto alloc_failure;
+/* How many members lie in x0..x1 of row y, and which x is the k-th of them
+ * (counting from 0, k must be less than the count).
+ */
+unsigned pointset_count_in_row(struct pointset *ps, int y, int x0, int x1)
+{
+    unsigned word, first = POINTSET_WORD(ps, x0, y), last = POINTSET_WORD(ps, x1, y);
+    unsigned n = 0;
+    uint64_t m;
 
-    drunk->rng = malloc(sizeof *drunk->rng);
-    if (!drunk->rng)
-        goto alloc_failure;
+    for (word = first; word <= last; ++word)
+    {
+        m = ps->bits[word];
+        if (word == first)
+            m &= MASK_FROM(x0);
+        if (word == last)
+            m &= MASK_TO(x1);
+        n += bit_popcount(m);
+    }
 
-    if (!pointset_init(drunk->markedset, w, h))
-        goto markedset_init_failure;
+    return n;
+}
 
-    if (!pointset_init(drunk->openedset, w, h))
-        goto openedset_init_failure;
+int pointset_select_in_row(struct pointset *ps, int y, int x0, int x1,
+    unsigned k)
+{
+    unsigned word, first = POINTSET_WORD(ps, x0, y), last = POINTSET_WORD(ps, x1, y);
+    unsigned n;
+    uint64_t m;
 
-    drunk->seed = time(NULL);
-    rng_seed(drunk->rng, drunk->seed);
+    for (word = first; word <= last; ++word)
+    {
+        m = ps->bits[word];
+        if (word == first)
+            m &= MASK_FROM(x0);
+        if (word == last)
+            m &= MASK_TO(x1);
+        n = bit_popcount(m);
+        if (k < n)
+            return (word - y * ps->stride) * WORD_BITS + bit_select(m, k);
+        k -= n;
+    }
+
+    return -1;
+}
+
+/* Row by row versions of the above for x0..x1 by y0..y1. */
+static unsigned pointset_count_rows(struct pointset *ps, int x0, int y0,
+    int x1, int y1)
+{
+    unsigned n = 0;
+    int y;
+
+    for (y = y0; y <= y1; ++y)
+        n += pointset_count_in_row(ps, y, x0, x1);
+    return n;
+}
+
+static struct point pointset_select_rows(struct pointset *ps, int x0, int y0,
+    int x1, int y1, unsigned k)
+{
+    unsigned n;
+    int y;
+
+    for (y = y0; y <= y1; ++y)
+    {
+        n = pointset_count_in_row(ps, y, x0, x1);
+        if (k < n)
+            return make_point(pointset_select_in_row(ps, y, x0, x1, k), y);
+        k -= n;
+    }
+
+    return make_point(-1, -1);
+}
+
+/* Members in area blocks bx0..bx1 - 1 by by0..by1 - 1. */
+static unsigned pointset_area_count(struct pointset *ps, unsigned bx0,
+    unsigned by0, unsigned bx1, unsigned by1)
+{
+    return pointset_area_prefix(ps, bx1, by1) - pointset_area_prefix(ps, bx0, by1) -
+        pointset_area_prefix(ps, bx1, by0) + pointset_area_prefix(ps, bx0, by0);
+}
+
+/* A rectangle split into the area blocks wholly inside it, counted from the
+ * fenwick tree, and up to four strips around them read from the bitmap.
+ */
+struct rect_pieces
+{
+    int strips[4][4];
+    int nstrips;
+    int bx0, by0, bx1, by1;
+};
+
+static void rect_split(struct pointset *ps, int x0, int y0, int x1, int y1,
+    struct rect_pieces *pieces)
+{
+    int bx0 = (x0 + WORD_BITS - 1) / WORD_BITS, bx1 = (x1 + 1) / WORD_BITS;
+    int by0 = (y0 + AREA_BLOCK_ROWS - 1) / AREA_BLOCK_ROWS;
+    int by1 = (y1 + 1) / AREA_BLOCK_ROWS;
+    int n = 0;
+
+#define RECT_STRIP(sx0, sy0, sx1, sy1) \
+    do { \
+        if ((sx0) <= (sx1) && (sy0) <= (sy1)) \
+        { \
+            pieces->strips[n][0] = (sx0); \
+            pieces->strips[n][1] = (sy0); \
+            pieces->strips[n][2] = (sx1); \
+            pieces->strips[n][3] = (sy1); \
+            ++n; \
+        } \
+    } while (0)
+
+    if (!ps->area || bx0 >= bx1 || by0 >= by1)
+    {
+        RECT_STRIP(x0, y0, x1, y1);
+        bx0 = bx1 = by0 = by1 = 0;
+    }
+    else
+    {
+        RECT_STRIP(x0, y0, x1, by0 * AREA_BLOCK_ROWS - 1);
+        RECT_STRIP(x0, by0 * AREA_BLOCK_ROWS, bx0 * WORD_BITS - 1,
+            by1 * AREA_BLOCK_ROWS - 1);
+        RECT_STRIP(bx1 * WORD_BITS, by0 * AREA_BLOCK_ROWS, x1,
+            by1 * AREA_BLOCK_ROWS - 1);
+        RECT_STRIP(x0, by1 * AREA_BLOCK_ROWS, x1, y1);
+    }
+
+#undef RECT_STRIP
+
+    pieces->nstrips = n;
+    pieces->bx0 = bx0;
+    pieces->by0 = by0;
+    pieces->bx1 = bx1;
+    pieces->by1 = by1;
+}
+
+/* Rectangle versions of the above, x0..x1 by y0..y1 in bounds. Members are
+ * counted in a fixed order, though not row major. With the area blocks of an
+ * area set this costs O(log^3 n) plus the rectangle's perimeter rather
+ * than its area.
+ */
+unsigned pointset_count_on_rect(struct pointset *ps, int x0, int y0, int x1,
+    int y1)
+{
+    struct rect_pieces pieces;
+    unsigned n = 0;
+    int i;
+
+    rect_split(ps, x0, y0, x1, y1, &pieces);
+    for (i = 0; i < pieces.nstrips; ++i)
+        n += pointset_count_rows(ps, pieces.strips[i][0], pieces.strips[i][1],
+            pieces.strips[i][2], pieces.strips[i][3]);
+    if (pieces.bx0 < pieces.bx1)
+        n += pointset_area_count(ps, pieces.bx0, pieces.by0, pieces.bx1,
+            pieces.by1);
+    return n;
+}
+
+struct point pointset_select_on_rect(struct pointset *ps, int x0, int y0,
+    int x1, int y1, unsigned k)
+{
+    struct rect_pieces pieces;
+    unsigned n, lo, hi, mid, bx, by;
+    int i;
+
+    rect_split(ps, x0, y0, x1, y1, &pieces);
+    for (i = 0; i < pieces.nstrips; ++i)
+    {
+        n = pointset_count_rows(ps, pieces.strips[i][0], pieces.strips[i][1],
+            pieces.strips[i][2], pieces.strips[i][3]);
+        if (k < n)
+            return pointset_select_rows(ps, pieces.strips[i][0],
+                pieces.strips[i][1], pieces.strips[i][2], pieces.strips[i][3], k);
+        k -= n;
+    }
+
+    if (pieces.bx0 >= pieces.bx1 ||
+        k >= pointset_area_count(ps, pieces.bx0, pieces.by0, pieces.bx1,
+            pieces.by1))
+        return make_point(-1, -1);
+
+    /* The block row holding the k-th member, then the block in it. */
+    lo = pieces.by0;
+    hi = pieces.by1 - 1;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (pointset_area_count(ps, pieces.bx0, pieces.by0, pieces.bx1,
+            mid + 1) > k)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    by = lo;
+    k -= pointset_area_count(ps, pieces.bx0, pieces.by0, pieces.bx1, by);
+
+    lo = pieces.bx0;
+    hi = pieces.bx1 - 1;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (pointset_area_count(ps, pieces.bx0, by, mid + 1, by + 1) > k)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    bx = lo;
+    k -= pointset_area_count(ps, pieces.bx0, by, bx, by + 1);
+
+    return pointset_select_rows(ps, bx * WORD_BITS, by * AREA_BLOCK_ROWS,
+        bx * WORD_BITS + WORD_BITS - 1, by * AREA_BLOCK_ROWS + AREA_BLOCK_ROWS - 1,
+        k);
+}
+
+/* Whether any member lies in x0..x1 by y0..y1, which must be in bounds.
+ * Like pointset_count_on_rect but stops at the first one found.
+ */
+bool pointset_any_on_rect(struct pointset *ps, int x0, int y0, int x1, int y1)
+{
+    struct rect_pieces pieces;
+    int i, y;
+
+    rect_split(ps, x0, y0, x1, y1, &pieces);
+    if (pieces.bx0 < pieces.bx1 &&
+        pointset_area_count(ps, pieces.bx0, pieces.by0, pieces.bx1, pieces.by1))
+        return true;
+
+    for (i = 0; i < pieces.nstrips; ++i)
+        for (y = pieces.strips[i][1]; y <= pieces.strips[i][3]; ++y)
+            if (pointset_first_in_row(ps, y, pieces.strips[i][0],
+                pieces.strips[i][2]) >= 0)
+                return true;
+
+    return false;
+}
+
+/* Adds every member of the sparse set src to ps, a word at a time. */
+void pointset_merge(struct pointset *ps, struct pointset *src)
+{
+    unsigned i, word;
+    uint64_t added;
+
+    for (i = 0; i < src->dirty_length; ++i)
+    {
+        word = src->dirty[i];
+        added = src->bits[word] & ~ps->bits[word];
+        if (!added)
+            continue;
+
+        ps->bits[word] |= added;
+        pointset_touch(ps, word);
+        pointset_count(ps, word, bit_popcount(added));
+    }
+}
+
+void pointset_clear(struct pointset *ps)
+{
+    unsigned i;
+
+    /* Only touched words can be set, so clearing them is enough and a flush
+     * costs as much as what was marked, not the whole map.
+     */
+    if (ps->dirty)
+    {
+        for (i = 0; i < ps->dirty_length; ++i)
+        {
+            ps->bits[ps->dirty[i]] = 0;
+            ps->dirty_bits[ps->dirty[i] / WORD_BITS] = 0;
+        }
+        ps->dirty_length = 0;
+    }
+    else
+    {
+        memset(ps->bits, 0, sizeof *ps->bits * ps->words);
+        if (ps->rank)
+            memset(ps->rank, 0, sizeof *ps->rank * (ps->blocks + 1));
+        if (ps->area)
+            memset(ps->area, 0, sizeof *ps->area *
+                (ps->area_width + 1) * (ps->area_height + 1));
+    }
+
+    ps->length = 0;
+}
+
+/******************************************************************************\
+Drunkard.
+\******************************************************************************/
+
+#define STACK_SIZE 256
+
+#define TILE_INDEX(d, x, y) ((y) * (d)->width + (x))
+
+/* A set of steps for the weighted walk, with the thresholds for weight laid
+ * out per sign of the offset to the target like step_table does for four
+ * directions. See neighborhood_table.
+ */
+struct neighborhood
+{
+    int dirs[DRUNKARD_NEIGHBORHOOD_MAX][2];
+    unsigned size;
+
+    double weight;
+    unsigned char order[9][DRUNKARD_NEIGHBORHOOD_MAX];
+    uint64_t thresholds[9][DRUNKARD_NEIGHBORHOOD_MAX];
+};
+
+/* left, right, top and bot already account for the border. */
+#define IN_BOUNDS(d, x, y) \
+    ((x) >= (d)->left && (x) <= (d)->right && (y) >= (d)->top && (y) <= (d)->bot)
+
+struct drunkard
+{
+    struct pointset *openedset;
+    struct pointset *markedset;
+    struct rng_state *rng;
+    unsigned seed;
+    unsigned stream;
+
+    /* Kernels that touch tiles switch on tile_size once and then load and
+     * store through a pointer of that width.
+     */
+    void *tiles;
+    enum drunkard_tile_size tile_size;
+    unsigned tile_mask;
+    unsigned width, height;
+    unsigned open_threshold;
+
+    bool border;
+    int top;
+    int bot;
+    int left;
+    int right;
+
+    int x, y;
+    int target_x, target_y;
+
+    /* Step thresholds for step_weight, see step_table. */
+    double step_weight;
+    uint64_t step_thresholds[2][3];
+
+    /* Allocated the first time they're used. */
+    struct neighborhood *eight;
+    struct neighborhood *custom;
+
+    unsigned char path_data[256];
+    bool (*pathing_function) (struct drunkard *);
+
+    /* Scratch space for cost paths, allocated on first use. */
+    struct path_arena *arena;
+
+    /* Circle half widths for every radius up to circle_radius, see
+     * circle_widths.
+     */
+    int *circle_widths;
+    int circle_radius;
+
+    /* Chebyshev distance from every cell to the nearest opened cell, capped
+     * at DISTANCE_FAR, when the distance field is on. Flushes spread it out
+     * from the newly opened cells; unopening cells marks it stale and it is
+     * rebuilt when next read.
+     */
+    uint8_t *distance;
+    unsigned *distance_queue;
+    bool distance_stale;
+
+    /* The top left corners of every free_lx by free_ly box in bounds that
+     * holds no opened cell, for drunkard_random_free_rect. Flushes take out
+     * the corners of boxes around newly opened cells; anything else marks
+     * it stale and it is rebuilt when next read.
+     */
+    struct pointset *free_corners;
+    uint64_t *free_bits;
+    int free_lx, free_ly;
+    bool free_stale;
+};
+
+/* Everything an A* search needs, sized for the whole map once and reused.
+ * A cell's cost and parent are only valid when its stamp is the current
+ * search's, so nothing has to be cleared between searches.
+ */
+struct heap_node
+{
+    unsigned f;
+    unsigned cell;
+};
+
+struct path_arena
+{
+    unsigned *cost;
+    unsigned *stamp;
+    unsigned char *from;
+    unsigned search;
+
+    struct heap_node *heap;
+    unsigned heap_length, heap_capacity;
+
+    unsigned *path;
+    unsigned path_length;
+};
+
+void path_arena_destroy(struct path_arena *arena)
+{
+    if (arena)
+    {
+        free(arena->cost);
+        free(arena->stamp);
+        free(arena->from);
+        free(arena->heap);
+        free(arena->path);
+        free(arena);
+    }
+}
+
+struct path_arena *path_arena_create(unsigned cells)
+{
+    struct path_arena *arena = malloc(sizeof *arena);
+    if (!arena)
+        goto alloc_failure;
+
+    memset(arena, 0, sizeof *arena);
+    arena->cost = malloc(sizeof *arena->cost * cells);
+    arena->stamp = calloc(cells, sizeof *arena->stamp);
+    arena->from = malloc(sizeof *arena->from * cells);
+    arena->path = malloc(sizeof *arena->path * cells);
+    arena->heap_capacity = 256;
+    arena->heap = malloc(sizeof *arena->heap * arena->heap_capacity);
+    if (!arena->cost || !arena->stamp || !arena->from || !arena->path ||
+        !arena->heap)
+        goto alloc_failure;
+
+    return arena;
+
+alloc_failure:
+    path_arena_destroy(arena);
+    return NULL;
+}
+
+static bool heap_push(struct path_arena *arena, unsigned f, unsigned cell)
+{
+    struct heap_node *heap, node;
+    unsigned i, parent;
+
+    if (arena->heap_length == arena->heap_capacity)
+    {
+        heap = realloc(arena->heap, sizeof *heap * arena->heap_capacity * 2);
+        if (!heap)
+            return false;
+        arena->heap = heap;
+        arena->heap_capacity *= 2;
+    }
+
+    heap = arena->heap;
+    node.f = f;
+    node.cell = cell;
+    for (i = arena->heap_length++; i > 0; i = parent)
+    {
+        parent = (i - 1) / 2;
+        if (heap[parent].f <= f)
+            break;
+        heap[i] = heap[parent];
+    }
+    heap[i] = node;
+    return true;
+}
+
+static struct heap_node heap_pop(struct path_arena *arena)
+{
+    struct heap_node *heap = arena->heap;
+    struct heap_node top = heap[0], last = heap[--arena->heap_length];
+    unsigned i = 0, child, n = arena->heap_length;
+
+    while ((child = i * 2 + 1) < n)
+    {
+        if (child + 1 < n && heap[child + 1].f < heap[child].f)
+            child++;
+        if (last.f <= heap[child].f)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static const int eight_dirs[8][2] =
+{
+    {-1, -1}, { 0, -1}, { 1, -1},
+    {-1,  0},           { 1,  0},
+    {-1,  1}, { 0,  1}, { 1,  1}
+};
+
+struct drunkard *drunkard_create(unsigned *tiles, unsigned w, unsigned h)
+{
+    return drunkard_create_sized(tiles, w, h, DRUNKARD_TILE_32);
+}
+
+struct drunkard *drunkard_create_sized(void *tiles, unsigned w, unsigned h,
+    enum drunkard_tile_size size)
+{
+    struct drunkard *drunk;
+
+    if (size != DRUNKARD_TILE_8 && size != DRUNKARD_TILE_16 &&
+        size != DRUNKARD_TILE_32)
+        return NULL;
+
+    drunk = malloc(sizeof *drunk);
+    if (!drunk)
+        goto alloc_failure;
+
+    memset(drunk, 0, sizeof *drunk);
+
+    drunk->markedset = malloc(sizeof *drunk->markedset);
+    if (!drunk->markedset)
+        goto alloc_failure;
+
+    drunk->openedset = malloc(sizeof *drunk->openedset);
+    if (!drunk->openedset)
+        goto alloc_failure;
+
+    drunk->rng = malloc(sizeof *drunk->rng);
+    if (!drunk->rng)
+        goto alloc_failure;
+
+    if (!rng_init(drunk->rng, DRUNKARD_RNG_CMWC))
+        goto rng_init_failure;
+
+    if (!pointset_init(drunk->markedset, w, h, POINTSET_SPARSE))
+        goto markedset_init_failure;
+
+    if (!pointset_init(drunk->openedset, w, h, POINTSET_AREA))
+        goto openedset_init_failure;
+
+    drunk->seed = time(NULL);
+    drunk->stream = 0;
+    rng_seed(drunk->rng, drunk->seed, drunk->stream);
 
     drunk->tiles = tiles;
+    drunk->tile_size = size;
+    switch (size)
+    {
+    case DRUNKARD_TILE_8:
+        drunk->tile_mask = UINT8_MAX;
+        break;
+    case DRUNKARD_TILE_16:
+        drunk->tile_mask = UINT16_MAX;
+        break;
+    case DRUNKARD_TILE_32:
+        drunk->tile_mask = ~0u;
+        break;
+    }
     drunk->width = w;
     drunk->height = h;
     drunk->open_threshold = 1;
@@ -317,79 +1546,604 @@ struct drunkard *drunkard_create(unsigned *tiles, unsigned w, unsigned h)
     drunk->target_x = -1;
     drunk->target_y = -1;
 
-    drunk->pathing_function = NULL;
+    drunk->step_weight = -1;
+
+    drunk->pathing_function = NULL;
+
+    drunk->circle_radius = -1;
+
+    return drunk;
+
+openedset_init_failure:
+    pointset_uninit(drunk->markedset);
+markedset_init_failure:
+    rng_uninit(drunk->rng);
+rng_init_failure:
+alloc_failure:
+    if (drunk->rng)
+        free(drunk->rng);
+    if (drunk->openedset)
+        free(drunk->openedset);
+    if (drunk->markedset)
+        free(drunk->markedset);
+    if (drunk)
+        free(drunk);
+    return NULL;
+}
+
+void drunkard_destroy(struct drunkard *drunk)
+{
+    pointset_uninit(drunk->markedset);
+    pointset_uninit(drunk->openedset);
+    rng_uninit(drunk->rng);
+    path_arena_destroy(drunk->arena);
+    free(drunk->circle_widths);
+    free(drunk->distance);
+    free(drunk->distance_queue);
+    if (drunk->free_corners)
+    {
+        pointset_uninit(drunk->free_corners);
+        free(drunk->free_corners);
+    }
+    free(drunk->free_bits);
+    free(drunk->eight);
+    free(drunk->custom);
+    if (drunk->rng)
+        free(drunk->rng);
+    if (drunk->openedset)
+        free(drunk->openedset);
+    if (drunk->markedset)
+        free(drunk->markedset);
+    free(drunk);
+}
+
+bool drunkard_is_opened(struct drunkard *drunk, int x, int y)
+{
+    return pointset_has(drunk->openedset, make_point(x, y));
+}
+
+bool drunkard_is_marked(struct drunkard *drunk, int x, int y)
+{
+    return pointset_has(drunk->markedset, make_point(x, y));
+}
+
+void drunkard_set_open_threshold(struct drunkard *drunk, unsigned threshold)
+{
+    drunk->open_threshold = threshold;
+}
+
+/* Marks an in bounds cell with a tile already truncated to the tile width.
+ * opens is whether tile reaches the open threshold.
+ */
+static void mark_unchecked(struct drunkard *drunk, int x, int y,
+    unsigned tile, bool opens)
+{
+    if (opens)
+    {
+        pointset_add(drunk->markedset, make_point(x, y));
+    }
+    else
+    {
+        pointset_rem(drunk->markedset, make_point(x, y));
+        if (pointset_rem(drunk->openedset, make_point(x, y)))
+            drunk->distance_stale = drunk->free_stale = true;
+    }
+
+    switch (drunk->tile_size)
+    {
+    case DRUNKARD_TILE_8:
+        ((uint8_t *)drunk->tiles)[TILE_INDEX(drunk, x, y)] = tile;
+        break;
+    case DRUNKARD_TILE_16:
+        ((uint16_t *)drunk->tiles)[TILE_INDEX(drunk, x, y)] = tile;
+        break;
+    case DRUNKARD_TILE_32:
+        ((unsigned *)drunk->tiles)[TILE_INDEX(drunk, x, y)] = tile;
+        break;
+    }
+}
+
+void drunkard_mark(struct drunkard *drunk, int x, int y, unsigned tile)
+{
+    if (IN_BOUNDS(drunk, x, y))
+    {
+        tile &= drunk->tile_mask;
+        mark_unchecked(drunk, x, y, tile, tile >= drunk->open_threshold);
+    }
+}
+
+/* mark_unchecked for the in bounds cells x0..x1 of row y. */
+static void mark_row(struct drunkard *drunk, int y, int x0, int x1,
+    unsigned tile, bool opens)
+{
+    unsigned i = TILE_INDEX(drunk, x0, y), n = x1 - x0 + 1, j;
+
+    if (opens)
+    {
+        pointset_add_row(drunk->markedset, y, x0, x1);
+    }
+    else
+    {
+        unsigned opened = drunk->openedset->length;
+
+        pointset_rem_row(drunk->markedset, y, x0, x1);
+        pointset_rem_row(drunk->openedset, y, x0, x1);
+        if (drunk->openedset->length != opened)
+            drunk->distance_stale = drunk->free_stale = true;
+    }
+
+    switch (drunk->tile_size)
+    {
+    case DRUNKARD_TILE_8:
+        memset((uint8_t *)drunk->tiles + i, tile, n);
+        break;
+    case DRUNKARD_TILE_16:
+        {
+            uint16_t *row = (uint16_t *)drunk->tiles + i;
+            for (j = 0; j < n; ++j)
+                row[j] = tile;
+        }
+        break;
+    case DRUNKARD_TILE_32:
+        {
+            unsigned *row = (unsigned *)drunk->tiles + i;
+            for (j = 0; j < n; ++j)
+                row[j] = tile;
+        }
+        break;
+    }
+}
+
+/* mark_row for x0..x1 of row y clipped to the bounds; tile is already
+ * truncated.
+ */
+static void mark_span(struct drunkard *drunk, int y, int x0, int x1,
+    unsigned tile, bool opens)
+{
+    if (y < drunk->top || y > drunk->bot)
+        return;
+    if (x0 < drunk->left)
+        x0 = drunk->left;
+    if (x1 > drunk->right)
+        x1 = drunk->right;
+    if (x0 <= x1)
+        mark_row(drunk, y, x0, x1, tile, opens);
+}
+
+/* Radii past this are computed per call rather than cached. */
+#define CIRCLE_CACHE_RADIUS 256
+
+/* Half widths of the rows dy = 0..r of a circle of radius r, or NULL if r
+ * is too big to cache or the table could not grow. Tables for radii
+ * 0..circle_radius are packed one after the other, radius r starting at
+ * r * (r + 1) / 2, and only grow when a bigger radius is asked for.
+ */
+static const int *circle_widths(struct drunkard *drunk, int r)
+{
+    int *widths;
+    int radius, dy;
+
+    if (r > CIRCLE_CACHE_RADIUS)
+        return NULL;
+
+    if (r > drunk->circle_radius)
+    {
+        widths = realloc(drunk->circle_widths,
+            sizeof *widths * (r + 1) * (r + 2) / 2);
+        if (!widths)
+            return NULL;
+
+        for (radius = drunk->circle_radius + 1; radius <= r; ++radius)
+            for (dy = 0; dy <= radius; ++dy)
+                widths[radius * (radius + 1) / 2 + dy] =
+                    floor(sqrt(radius * radius - dy * dy));
+
+        drunk->circle_widths = widths;
+        drunk->circle_radius = r;
+    }
+
+    return drunk->circle_widths + r * (r + 1) / 2;
+}
+
+/* Half width of row dy of a circle of radius r from widths, computing it
+ * when there is no table.
+ */
+static int circle_width(const int *widths, int r, int dy)
+{
+    if (dy < 0)
+        dy = -dy;
+    return widths ? widths[dy] : floor(sqrt(r * r - dy * dy));
+}
+
+/* Distances at or past this are stored as this, which also bounds how far
+ * a flush spreads. Farther distances are searched for.
+ */
+#define DISTANCE_FAR 64
+
+/* Recomputes the whole distance field with a forward and a backward
+ * chamfer pass, which is exact for Chebyshev distances.
+ */
+static void distance_rebuild(struct drunkard *drunk)
+{
+    uint8_t *d = drunk->distance;
+    int w = drunk->width, h = drunk->height;
+    int x, y, i;
+    unsigned v;
+
+#define DISTANCE_MIN(j) \
+    do { if (d[j] + 1u < v) v = d[j] + 1u; } while (0)
+
+    for (y = 0; y < h; ++y)
+    {
+        for (x = 0; x < w; ++x)
+        {
+            i = y * w + x;
+            v = pointset_has(drunk->openedset, make_point(x, y)) ? 0 : DISTANCE_FAR;
+            if (x > 0)
+                DISTANCE_MIN(i - 1);
+            if (y > 0)
+            {
+                DISTANCE_MIN(i - w);
+                if (x > 0)
+                    DISTANCE_MIN(i - w - 1);
+                if (x < w - 1)
+                    DISTANCE_MIN(i - w + 1);
+            }
+            d[i] = v;
+        }
+    }
+
+    for (y = h - 1; y >= 0; --y)
+    {
+        for (x = w - 1; x >= 0; --x)
+        {
+            i = y * w + x;
+            v = d[i];
+            if (x < w - 1)
+                DISTANCE_MIN(i + 1);
+            if (y < h - 1)
+            {
+                DISTANCE_MIN(i + w);
+                if (x > 0)
+                    DISTANCE_MIN(i + w - 1);
+                if (x < w - 1)
+                    DISTANCE_MIN(i + w + 1);
+            }
+            d[i] = v;
+        }
+    }
+
+#undef DISTANCE_MIN
+
+    drunk->distance_stale = false;
+}
+
+/* Lowers the distance field around the cells marked but not yet opened,
+ * stopping wherever a cell is no closer to them than it already was to
+ * something else.
+ */
+static void distance_spread(struct drunkard *drunk)
+{
+    struct pointset *marked = drunk->markedset;
+    uint8_t *d = drunk->distance;
+    unsigned *queue = drunk->distance_queue;
+    unsigned head = 0, tail = 0, i, word, cell;
+    int w = drunk->width, h = drunk->height;
+    int x, y, dx, dy, nx, ny;
+    uint64_t added;
+
+    for (i = 0; i < marked->dirty_length; ++i)
+    {
+        word = marked->dirty[i];
+        added = marked->bits[word] & ~drunk->openedset->bits[word];
+        for (; added; added &= added - 1)
+        {
+            x = (word % marked->stride) * WORD_BITS + bit_ctz(added);
+            cell = TILE_INDEX(drunk, x, word / marked->stride);
+            d[cell] = 0;
+            queue[tail++] = cell;
+        }
+    }
+
+    /* Every source starts at 0, so a cell is only ever lowered once. */
+    while (head < tail)
+    {
+        cell = queue[head++];
+        x = cell % w;
+        y = cell / w;
+        for (dy = -1; dy <= 1; ++dy)
+        {
+            for (dx = -1; dx <= 1; ++dx)
+            {
+                nx = x + dx;
+                ny = y + dy;
+                if (nx < 0 || ny < 0 || nx >= w || ny >= h)
+                    continue;
+                if (d[ny * w + nx] > d[cell] + 1)
+                {
+                    d[ny * w + nx] = d[cell] + 1;
+                    queue[tail++] = ny * w + nx;
+                }
+            }
+        }
+    }
+}
+
+/* ORs bit x + s into bit x of a row of words, for every x. Only words at or
+ * after the one written are read, so it works in place.
+ */
+static void row_or_ahead(uint64_t *row, unsigned words, unsigned s)
+{
+    unsigned i, q = s / WORD_BITS, r = s % WORD_BITS;
+    uint64_t v;
+
+    for (i = 0; i + q < words; ++i)
+    {
+        v = row[i + q] >> r;
+        if (r && i + q + 1 < words)
+            v |= row[i + q + 1] << (WORD_BITS - r);
+        row[i] |= v;
+    }
+}
+
+/* Turns bits into whether any bit of the lx by ly box with its top left
+ * corner there was set, by doubling the box each pass: O(words log size).
+ */
+static void bits_dilate(uint64_t *bits, unsigned stride, unsigned height,
+    unsigned lx, unsigned ly)
+{
+    unsigned y, i, s;
+
+    for (y = 0; y < height; ++y)
+    {
+        for (s = 1; s * 2 <= lx; s *= 2)
+            row_or_ahead(bits + y * stride, stride, s);
+        if (lx > s)
+            row_or_ahead(bits + y * stride, stride, lx - s);
+    }
+
+    for (s = 1; s * 2 <= ly; s *= 2)
+        for (y = 0; y + s < height; ++y)
+            for (i = 0; i < stride; ++i)
+                bits[y * stride + i] |= bits[(y + s) * stride + i];
+    if (ly > s)
+        for (y = 0; y + ly - s < height; ++y)
+            for (i = 0; i < stride; ++i)
+                bits[y * stride + i] |= bits[(y + ly - s) * stride + i];
+}
+
+/* Rebuilds free_corners for lx by ly boxes from the opened set. */
+static void free_rect_rebuild(struct drunkard *drunk, int lx, int ly)
+{
+    struct pointset *ps = drunk->free_corners;
+    uint64_t *bits = drunk->free_bits, m;
+    int x0 = drunk->left, x1 = drunk->right - lx + 1;
+    int y0 = drunk->top, y1 = drunk->bot - ly + 1;
+    unsigned word, first, last;
+    int y;
+
+    memcpy(bits, drunk->openedset->bits, sizeof *bits * ps->words);
+    bits_dilate(bits, ps->stride, ps->height, lx, ly);
+
+    pointset_clear(ps);
+    for (y = y0; x0 <= x1 && y <= y1; ++y)
+    {
+        first = POINTSET_WORD(ps, x0, y);
+        last = POINTSET_WORD(ps, x1, y);
+        for (word = first; word <= last; ++word)
+        {
+            m = ~bits[word];
+            if (word == first)
+                m &= MASK_FROM(x0);
+            if (word == last)
+                m &= MASK_TO(x1);
+            ps->bits[word] = m;
+            if (m)
+                pointset_count(ps, word, bit_popcount(m));
+        }
+    }
+
+    drunk->free_lx = lx;
+    drunk->free_ly = ly;
+    drunk->free_stale = false;
+}
 
-    return drunk;
+/* Takes the corners cx0..cx1 out of the rows of free_corners whose boxes
+ * reach row y.
+ */
+static void free_rect_rem(struct drunkard *drunk, int y, int cx0, int cx1)
+{
+    int x0 = drunk->left, x1 = drunk->right - drunk->free_lx + 1;
+    int y0 = drunk->top, y1 = drunk->bot - drunk->free_ly + 1;
+    int cy;
+
+    if (cx0 < x0)
+        cx0 = x0;
+    if (cx1 > x1)
+        cx1 = x1;
+    if (cx0 > cx1)
+        return;
+    for (cy = y - drunk->free_ly + 1 > y0 ? y - drunk->free_ly + 1 : y0;
+        cy <= y && cy <= y1; ++cy)
+        pointset_rem_row(drunk->free_corners, cy, cx0, cx1);
+}
+
+/* Takes out of free_corners every box that holds a cell marked but not yet
+ * opened. The boxes of neighbouring cells in a word overlap, so each run of
+ * corners goes out a row at a time rather than cell by cell.
+ */
+static void free_rect_spread(struct drunkard *drunk)
+{
+    struct pointset *marked = drunk->markedset;
+    int x, y, run0, run1;
+    unsigned i, word;
+    uint64_t added;
 
-openedset_init_failure:
-    pointset_uninit(drunk->markedset);
-markedset_init_failure:
-alloc_failure:
-    if (drunk->rng)
-        free(drunk->rng);
-    if (drunk->openedset)
-        free(drunk->openedset);
-    if (drunk->markedset)
-        free(drunk->markedset);
-    if (drunk)
-        free(drunk);
-    return NULL;
+    for (i = 0; i < marked->dirty_length; ++i)
+    {
+        word = marked->dirty[i];
+        added = marked->bits[word] & ~drunk->openedset->bits[word];
+        if (!added)
+            continue;
+
+        y = word / marked->stride;
+        run0 = 0;
+        run1 = -1;
+        for (; added; added &= added - 1)
+        {
+            x = (word % marked->stride) * WORD_BITS + bit_ctz(added);
+            if (run1 >= 0 && x - drunk->free_lx + 1 <= run1 + 1)
+            {
+                run1 = x;
+                continue;
+            }
+            if (run1 >= 0)
+                free_rect_rem(drunk, y, run0, run1);
+            run0 = x - drunk->free_lx + 1;
+            run1 = x;
+        }
+        free_rect_rem(drunk, y, run0, run1);
+    }
 }
 
-void drunkard_destroy(struct drunkard *drunk)
+bool drunkard_random_free_rect(struct drunkard *drunk, unsigned hw, unsigned hh,
+    unsigned *x, unsigned *y)
 {
-    pointset_uninit(drunk->markedset);
-    pointset_uninit(drunk->openedset);
-    if (drunk->rng)
-        free(drunk->rng);
-    if (drunk->openedset)
-        free(drunk->openedset);
-    if (drunk->markedset)
-        free(drunk->markedset);
-    free(drunk);
+    /* The box drunkard_is_opened_on_rect checks. */
+    int lx = 2 * hw + 3, ly = 2 * hh + 3;
+    struct point p;
+
+    if (!drunk->free_corners)
+    {
+        drunk->free_corners = malloc(sizeof *drunk->free_corners);
+        if (!drunk->free_corners)
+            return false;
+        if (!pointset_init(drunk->free_corners, drunk->width, drunk->height,
+            POINTSET_RANKED))
+        {
+            free(drunk->free_corners);
+            drunk->free_corners = NULL;
+            return false;
+        }
+        drunk->free_bits = malloc(sizeof *drunk->free_bits *
+            drunk->free_corners->words);
+        if (!drunk->free_bits)
+        {
+            pointset_uninit(drunk->free_corners);
+            free(drunk->free_corners);
+            drunk->free_corners = NULL;
+            return false;
+        }
+        drunk->free_stale = true;
+    }
+
+    if (drunk->free_stale || lx != drunk->free_lx || ly != drunk->free_ly)
+        free_rect_rebuild(drunk, lx, ly);
+
+    if (!drunk->free_corners->length)
+        return false;
+    p = pointset_random(drunk->free_corners, drunk->rng);
+    *x = p.x + hw + 1;
+    *y = p.y + hh + 1;
+    return true;
 }
 
-bool drunkard_is_opened(struct drunkard *drunk, int x, int y)
+void drunkard_flush_marks(struct drunkard *drunk)
 {
-    return pointset_has(drunk->openedset, make_point(x, y));
+    if (drunk->distance && !drunk->distance_stale)
+        distance_spread(drunk);
+    if (drunk->free_corners && !drunk->free_stale)
+        free_rect_spread(drunk);
+    pointset_merge(drunk->openedset, drunk->markedset);
+    pointset_clear(drunk->markedset);
 }
 
-bool drunkard_is_marked(struct drunkard *drunk, int x, int y)
+bool drunkard_set_distance_field(struct drunkard *drunk, bool yes)
 {
-    return pointset_has(drunk->markedset, make_point(x, y));
+    if (!yes)
+    {
+        free(drunk->distance);
+        free(drunk->distance_queue);
+        drunk->distance = NULL;
+        drunk->distance_queue = NULL;
+        return true;
+    }
+
+    if (!drunk->distance)
+    {
+        drunk->distance = malloc(drunk->width * drunk->height);
+        drunk->distance_queue = malloc(sizeof *drunk->distance_queue *
+            drunk->width * drunk->height);
+        if (!drunk->distance || !drunk->distance_queue)
+        {
+            drunkard_set_distance_field(drunk, false);
+            return false;
+        }
+        drunk->distance_stale = true;
+    }
+
+    return true;
 }
 
-void drunkard_set_open_threshold(struct drunkard *drunk, unsigned threshold)
+/* Whether an opened cell lies within r of x, y, on the map. */
+static bool opened_within(struct drunkard *drunk, int x, int y, int r)
 {
-    drunk->open_threshold = threshold;
+    return pointset_any_on_rect(drunk->openedset,
+        x - r > 0 ? x - r : 0, y - r > 0 ? y - r : 0,
+        x + r < (int)drunk->width ? x + r : (int)drunk->width - 1,
+        y + r < (int)drunk->height ? y + r : (int)drunk->height - 1);
 }
 
-void drunkard_mark(struct drunkard *drunk, int x, int y, unsigned tile)
+/* Chebyshev distance from x, y on the map to the nearest opened cell, or
+ * limit if it's no nearer. Read from the distance field when it's on and
+ * otherwise searched for.
+ */
+static int opened_radius(struct drunkard *drunk, int x, int y, int limit)
 {
-    if (IN_BOUNDS(drunk, x, y))
+    int lo = 0, hi = limit, mid;
+    unsigned d;
+
+    if (drunk->distance)
     {
-        if (tile >= drunk->open_threshold)
-        {
-            pointset_add(drunk->markedset, make_point(x, y));
-        }
+        if (drunk->distance_stale)
+            distance_rebuild(drunk);
+        d = drunk->distance[TILE_INDEX(drunk, x, y)];
+        if (d < DISTANCE_FAR || limit <= DISTANCE_FAR)
+            return (int)d < limit ? (int)d : limit;
+        lo = DISTANCE_FAR;
+    }
+
+    /* The smallest square around x, y that holds an opened cell. */
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (opened_within(drunk, x, y, mid))
+            hi = mid;
         else
-        {
-            pointset_rem(drunk->markedset, make_point(x, y));
-            pointset_rem(drunk->openedset, make_point(x, y));
-        }
-        TILE_AT(drunk, x, y) = tile;
+            lo = mid + 1;
     }
+
+    return lo;
 }
 
-void drunkard_flush_marks(struct drunkard *drunk)
+unsigned drunkard_distance_to_opened(struct drunkard *drunk, int x, int y)
 {
-    unsigned i;
-    struct point *pi;
+    int edge;
 
-    POINTSET_FOR(drunk->markedset, i, pi)
-    pointset_add(drunk->openedset, *pi);
+    if (!IN_BOUNDS(drunk, x, y))
+        return 0;
 
-    pointset_clear(drunk->markedset);
+    /* How far the nearest cell out of bounds is. */
+    edge = x - drunk->left;
+    if (drunk->right - x < edge)
+        edge = drunk->right - x;
+    if (y - drunk->top < edge)
+        edge = y - drunk->top;
+    if (drunk->bot - y < edge)
+        edge = drunk->bot - y;
+    edge++;
+
+    return opened_radius(drunk, x, y, edge);
 }
 
 void drunkard_set_border(struct drunkard *drunk, bool yes)
@@ -409,6 +2163,7 @@ void drunkard_set_border(struct drunkard *drunk, bool yes)
         drunk->left = 0;
         drunk->right = drunk->width - 1;
     }
+    drunk->free_stale = true;
 }
 
 unsigned drunkard_count_opened(struct drunkard *drunk)
@@ -464,10 +2219,51 @@ unsigned drunkard_get_seed(struct drunkard *drunk)
     return drunk->seed;
 }
 
+unsigned drunkard_get_stream(struct drunkard *drunk)
+{
+    return drunk->stream;
+}
+
 void drunkard_seed(struct drunkard *drunk, unsigned s)
+{
+    drunkard_seed_stream(drunk, s, 0);
+}
+
+void drunkard_seed_stream(struct drunkard *drunk, unsigned s, unsigned stream)
 {
     drunk->seed = s;
-    rng_seed(drunk->rng, s);
+    drunk->stream = stream;
+    rng_seed(drunk->rng, s, stream);
+}
+
+/* Swaps in an unseeded generator of type, keeping the old one on failure. */
+static bool replace_rng(struct drunkard *drunk, enum drunkard_rng type)
+{
+    struct rng_state st;
+
+    if (!rng_init(&st, type))
+        return false;
+
+    rng_uninit(drunk->rng);
+    *drunk->rng = st;
+    return true;
+}
+
+bool drunkard_fork(struct drunkard *child, struct drunkard *parent,
+    unsigned stream)
+{
+    if (!replace_rng(child, parent->rng->type))
+        return false;
+    drunkard_seed_stream(child, parent->seed, stream);
+    return true;
+}
+
+bool drunkard_set_rng(struct drunkard *drunk, enum drunkard_rng type)
+{
+    if (!replace_rng(drunk, type))
+        return false;
+    rng_seed(drunk->rng, drunk->seed, drunk->stream);
+    return true;
 }
 
 double drunkard_rng_uniform(struct drunkard *drunk)
@@ -587,6 +2383,46 @@ void drunkard_start_random_opened(struct drunkard *drunk)
     drunk->y = p.y;
 }
 
+/* A uniformly random opened cell in x0..x1 by y0..y1 clipped to the map, or
+ * false if there is none.
+ */
+static bool random_opened_on_rect(struct drunkard *drunk, int x0, int y0,
+    int x1, int y1, struct point *p)
+{
+    unsigned n;
+
+    if (x0 < 0)
+        x0 = 0;
+    if (y0 < 0)
+        y0 = 0;
+    if (x1 > (int)drunk->width - 1)
+        x1 = drunk->width - 1;
+    if (y1 > (int)drunk->height - 1)
+        y1 = drunk->height - 1;
+    if (x0 > x1 || y0 > y1)
+        return false;
+
+    n = pointset_count_on_rect(drunk->openedset, x0, y0, x1, y1);
+    if (!n)
+        return false;
+
+    *p = pointset_select_on_rect(drunk->openedset, x0, y0, x1, y1,
+        rng_range(drunk->rng, 0, n - 1));
+    return true;
+}
+
+bool drunkard_start_random_opened_on_rect(struct drunkard *drunk,
+    int x0, int y0, int x1, int y1)
+{
+    struct point p;
+
+    if (!random_opened_on_rect(drunk, x0, y0, x1, y1, &p))
+        return false;
+    drunk->x = p.x;
+    drunk->y = p.y;
+    return true;
+}
+
 /******************************************************************************\
 Targetting Functions.
 \******************************************************************************/
@@ -676,65 +2512,213 @@ void drunkard_target_random_opened(struct drunkard *drunk)
     drunk->target_y = p.y;
 }
 
+bool drunkard_target_nearest_opened(struct drunkard *drunk)
+{
+    struct pointset *ps = drunk->openedset;
+    int x = drunk->x, y = drunk->y, w = drunk->width, h = drunk->height;
+    int r, i, n, sides[4][4];
+    unsigned counts[4], total = 0, k;
+    struct point p;
+
+    if (!ps->length || x < 0 || y < 0 || x >= w || y >= h)
+        return false;
+
+    r = opened_radius(drunk, x, y, w > h ? w : h);
+
+    /* The ring r out as rows above and below and columns either side,
+     * clipped to the map, with a random member of it picked.
+     */
+    n = 0;
+#define RING_SIDE(sx0, sy0, sx1, sy1) \
+    do { \
+        sides[n][0] = (sx0) > 0 ? (sx0) : 0; \
+        sides[n][1] = (sy0) > 0 ? (sy0) : 0; \
+        sides[n][2] = (sx1) < w - 1 ? (sx1) : w - 1; \
+        sides[n][3] = (sy1) < h - 1 ? (sy1) : h - 1; \
+        if (sides[n][0] <= sides[n][2] && sides[n][1] <= sides[n][3]) \
+            ++n; \
+    } while (0)
+
+    RING_SIDE(x - r, y - r, x + r, y - r);
+    if (r > 0)
+    {
+        RING_SIDE(x - r, y + r, x + r, y + r);
+        RING_SIDE(x - r, y - r + 1, x - r, y + r - 1);
+        RING_SIDE(x + r, y - r + 1, x + r, y + r - 1);
+    }
+
+#undef RING_SIDE
+
+    for (i = 0; i < n; ++i)
+    {
+        counts[i] = pointset_count_on_rect(ps, sides[i][0], sides[i][1],
+            sides[i][2], sides[i][3]);
+        total += counts[i];
+    }
+
+    k = rng_range(drunk->rng, 0, total - 1);
+    for (i = 0; k >= counts[i]; ++i)
+        k -= counts[i];
+    p = pointset_select_on_rect(ps, sides[i][0], sides[i][1], sides[i][2],
+        sides[i][3], k);
+
+    drunk->target_x = p.x;
+    drunk->target_y = p.y;
+    return true;
+}
+
+bool drunkard_target_random_opened_within(struct drunkard *drunk, unsigned r)
+{
+    struct point p;
+
+    if (!random_opened_on_rect(drunk, drunk->x - (int)r, drunk->y - (int)r,
+        drunk->x + (int)r, drunk->y + (int)r, &p))
+        return false;
+    drunk->target_x = p.x;
+    drunk->target_y = p.y;
+    return true;
+}
+
+bool drunkard_target_random_opened_on_rect(struct drunkard *drunk,
+    int x0, int y0, int x1, int y1)
+{
+    struct point p;
+
+    if (!random_opened_on_rect(drunk, x0, y0, x1, y1, &p))
+        return false;
+    drunk->target_x = p.x;
+    drunk->target_y = p.y;
+    return true;
+}
+
 /******************************************************************************\
 Mark functions.
 \******************************************************************************/
 
+/* Cells each brush covers, relative to the drunkard. None reach
+ * further than BRUSH_REACH.
+ */
+static const int brushes[][5][2] =
+{
+    {{0, 0}},
+    {{0, 0}, {-1, 0}, {0, -1}, {0, 1}, {1, 0}},
+    {{0, 0}, {-1, -1}, {-1, 1}, {1, -1}, {1, 1}}
+};
+static const unsigned brush_sizes[] = {1, 5, 5};
+
+#define BRUSH_REACH 1
+
+/* Marks a brush at x, y and returns how many of its cells were in bounds.
+ * Away from the bounds, which is nearly everywhere, nothing is checked per
+ * cell.
+ */
+static unsigned mark_brush(struct drunkard *drunk, int x, int y,
+    enum drunkard_brush brush, unsigned tile, bool opens)
+{
+    const int (*cells)[2] = brushes[brush];
+    unsigned size = brush_sizes[brush], i, marks = 0;
+
+    if (x - BRUSH_REACH >= drunk->left && x + BRUSH_REACH <= drunk->right &&
+        y - BRUSH_REACH >= drunk->top && y + BRUSH_REACH <= drunk->bot)
+    {
+        for (i = 0; i < size; ++i)
+            mark_unchecked(drunk, x + cells[i][0], y + cells[i][1], tile, opens);
+        return size;
+    }
+
+    for (i = 0; i < size; ++i)
+    {
+        if (IN_BOUNDS(drunk, x + cells[i][0], y + cells[i][1]))
+        {
+            mark_unchecked(drunk, x + cells[i][0], y + cells[i][1], tile, opens);
+            marks++;
+        }
+    }
+    return marks;
+}
+
+/* mark_brush with the tile yet to be truncated. */
+static void mark_brush_tile(struct drunkard *drunk, enum drunkard_brush brush,
+    unsigned tile)
+{
+    tile &= drunk->tile_mask;
+    mark_brush(drunk, drunk->x, drunk->y, brush, tile,
+        tile >= drunk->open_threshold);
+}
+
 void drunkard_mark_all(struct drunkard *drunk, unsigned tile)
 {
-    unsigned x, y;
-    for (x = 0; x < drunk->width; ++x)
-        for (y = 0; y < drunk->height; ++y)
-            drunkard_mark(drunk, x, y, tile);
+    int y;
+
+    tile &= drunk->tile_mask;
+    for (y = drunk->top; y <= drunk->bot; ++y)
+        mark_span(drunk, y, drunk->left, drunk->right, tile,
+            tile >= drunk->open_threshold);
 }
 
 void drunkard_mark_1(struct drunkard *drunk, unsigned tile)
 {
-    drunkard_mark(drunk, drunk->x, drunk->y, tile);
+    mark_brush_tile(drunk, DRUNKARD_BRUSH_1, tile);
 }
 
 void drunkard_mark_plus(struct drunkard *drunk, unsigned tile)
 {
-    drunkard_mark(drunk, drunk->x, drunk->y, tile);
-    drunkard_mark(drunk, drunk->x - 1, drunk->y, tile);
-    drunkard_mark(drunk, drunk->x, drunk->y - 1, tile);
-    drunkard_mark(drunk, drunk->x, drunk->y + 1, tile);
-    drunkard_mark(drunk, drunk->x + 1, drunk->y, tile);
+    mark_brush_tile(drunk, DRUNKARD_BRUSH_PLUS, tile);
 }
 
 void drunkard_mark_x(struct drunkard *drunk, unsigned tile)
 {
-    drunkard_mark(drunk, drunk->x, drunk->y, tile);
-    drunkard_mark(drunk, drunk->x - 1, drunk->y - 1, tile);
-    drunkard_mark(drunk, drunk->x - 1, drunk->y + 1, tile);
-    drunkard_mark(drunk, drunk->x + 1, drunk->y - 1, tile);
-    drunkard_mark(drunk, drunk->x + 1, drunk->y + 1, tile);
+    mark_brush_tile(drunk, DRUNKARD_BRUSH_X, tile);
 }
 
 void drunkard_mark_rect(struct drunkard *drunk, int hw, int hh, unsigned tile)
 {
-    int x, y;
-    for (x = ceil(drunk->x - hw); x <= floor(drunk->x + hw); ++x)
-        for (y = ceil(drunk->y - hh); y <= floor(drunk->y + hh); ++y)
-            drunkard_mark(drunk, x, y, tile);
+    int y;
+
+    tile &= drunk->tile_mask;
+    for (y = drunk->y - hh; y <= drunk->y + hh; ++y)
+        mark_span(drunk, y, drunk->x - hw, drunk->x + hw, tile,
+            tile >= drunk->open_threshold);
 }
 
 void drunkard_mark_circle(struct drunkard *drunk, int r, unsigned tile)
 {
-    int dx, dy, h, x, y;
+    const int *widths;
+    int dy, h;
 
-    for (dx = -r; dx <= r; ++dx)
+    if (r < 0)
+        return;
+
+    widths = circle_widths(drunk, r);
+    tile &= drunk->tile_mask;
+    for (dy = -r; dy <= r; ++dy)
     {
-        h = floor(sqrt(r * r - dx * dx));
-        for (dy = -h; dy <= h; ++dy)
-        {
-            x = drunkard_get_x(drunk) + dx;
-            y = drunkard_get_y(drunk) + dy;
-            drunkard_mark(drunk, x, y, tile);
-        }
+        h = circle_width(widths, r, dy);
+        mark_span(drunk, drunk->y + dy, drunk->x - h, drunk->x + h, tile,
+            tile >= drunk->open_threshold);
     }
 }
 
+void drunkard_mark_span(struct drunkard *drunk, int y, int x0, int x1,
+    unsigned tile)
+{
+    tile &= drunk->tile_mask;
+    mark_span(drunk, y, x0, x1, tile, tile >= drunk->open_threshold);
+}
+
+void drunkard_mark_spans(struct drunkard *drunk,
+    const struct drunkard_span *spans, unsigned n, unsigned tile)
+{
+    unsigned i;
+    bool opens;
+
+    tile &= drunk->tile_mask;
+    opens = tile >= drunk->open_threshold;
+
+    for (i = 0; i < n; ++i)
+        mark_span(drunk, spans[i].y, spans[i].x0, spans[i].x1, tile, opens);
+}
+
 /******************************************************************************\
 Step functions.
 \******************************************************************************/
@@ -767,9 +2751,9 @@ void drunkard_step_random(struct drunkard *drunk)
     drunkard_step_by(drunk, dx, dy);
 }
 
-/* Okay, so here's the weighted walk algorith. Very sloppy, but I foresee it
- * changing a lot so I'm not too worried. The algorithm is hard coded and
- * not optimized... for now.
+/* Okay, so here's the weighted walk algorith. The chances below only depend
+ * on the weight, so they're turned into integer thresholds once per weight
+ * (see step_table) and each step is one 32 bit draw and a table lookup.
  *
  * The two cases you have in a four directional weighted walk is where the
  * walker is ON an axis that the target is on, and when the walker is not...
@@ -838,79 +2822,267 @@ void drunkard_step_random(struct drunkard *drunk)
  *        12.5%
  */
 
-void drunkard_step_to_target(struct drunkard *drunk, double weight)
+/* Directions in threshold order, indexed by (sign dx + 1) * 3 + sign dy + 1.
+ * On an axis it's straight to the target, the two sides, then away. Off the
+ * axes it's both directions towards the target and then both away.
+ */
+static const int step_dirs[9][4][2] =
+{
+    {{-1,  0}, { 0, -1}, { 1,  0}, { 0,  1}},
+    {{-1,  0}, { 0, -1}, { 0,  1}, { 1,  0}},
+    {{-1,  0}, { 0,  1}, { 1,  0}, { 0, -1}},
+    {{ 0, -1}, {-1,  0}, { 1,  0}, { 0,  1}},
+    {{ 0,  0}, { 0,  0}, { 0,  0}, { 0,  0}},
+    {{ 0,  1}, {-1,  0}, { 1,  0}, { 0, -1}},
+    {{ 1,  0}, { 0, -1}, {-1,  0}, { 0,  1}},
+    {{ 1,  0}, { 0, -1}, { 0,  1}, {-1,  0}},
+    {{ 1,  0}, { 0,  1}, {-1,  0}, { 0, -1}}
+};
+
+enum {STEP_OFF_AXIS, STEP_ON_AXIS};
+static const int step_axis[9] =
+{
+    STEP_OFF_AXIS, STEP_ON_AXIS, STEP_OFF_AXIS,
+    STEP_ON_AXIS, STEP_ON_AXIS, STEP_ON_AXIS,
+    STEP_OFF_AXIS, STEP_ON_AXIS, STEP_OFF_AXIS
+};
+
+/* A draw r (as a fraction of 2^32) is below the chance c exactly when the
+ * 32 bit draw is below ceil(c * 2^32).
+ */
+static uint64_t chance_threshold(double c)
+{
+    if (c <= 0)
+        return 0;
+    if (c >= 1)
+        return (uint64_t)1 << 32;
+    return (uint64_t)ceil(c * 4294967296.0);
+}
+
+static void step_table(struct drunkard *drunk, double weight)
+{
+    uint64_t *on = drunk->step_thresholds[STEP_ON_AXIS];
+    uint64_t *off = drunk->step_thresholds[STEP_OFF_AXIS];
+    double side = weight * (1.0 / 6) + (1 - weight) * (1.0 / 3);
+
+    on[0] = chance_threshold(weight * 0.5);
+    on[1] = chance_threshold(weight * 0.5 + side);
+    on[2] = chance_threshold(weight * 0.5 + side * 2);
+
+    off[0] = chance_threshold(weight * 0.5);
+    off[1] = chance_threshold(weight);
+    off[2] = chance_threshold(weight + (1 - weight) * 0.5);
+
+    drunk->step_weight = weight;
+}
+
+/* Picks the weighted step towards the target as described above. */
+static void choose_step(struct drunkard *drunk, double weight, int *pdx, int *pdy)
 {
     int dx = drunkard_get_dx_to_target(drunk);
     int dy = drunkard_get_dy_to_target(drunk);
+    int c, k;
+    uint64_t *t;
+    uint32_t r = rng_u32(drunk->rng);
 
-    if (dx >  1) dx = 1;
-    if (dx < -1) dx = -1;
-    if (dy >  1) dy = 1;
-    if (dy < -1) dy = -1;
+    if (weight != drunk->step_weight)
+        step_table(drunk, weight);
 
-    double r = drunkard_rng_uniform(drunk);
+    c = ((dx > 0) - (dx < 0) + 1) * 3 + (dy > 0) - (dy < 0) + 1;
+    t = drunk->step_thresholds[step_axis[c]];
+    k = (r >= t[0]) + (r >= t[1]) + (r >= t[2]);
 
-    if (dx == 0 && dy == 0)
-    {
-        /* On target, do nothing. */
-    }
-    else if (dx == 0 || dy == 0)
+    *pdx = step_dirs[c][k][0];
+    *pdy = step_dirs[c][k][1];
+}
+
+void drunkard_step_to_target(struct drunkard *drunk, double weight)
+{
+    int dx, dy;
+
+    choose_step(drunk, weight, &dx, &dy);
+    drunkard_step_by(drunk, dx, dy);
+}
+
+/* The weighted walk generalized to any set of n steps. The steps that head
+ * towards the target (a positive dot product with the sign of the offset)
+ * split a total chance between them, and the others split what's left
+ * evenly. With g of the n steps heading towards the target, the total is
+ * 2 * weight * g / n up to a weight of 0.5, an even spread, and from there
+ * rises linearly to 1 at a weight of 1. For the four directions and a
+ * diagonal target that's exactly the chances described above.
+ */
+static void neighborhood_table(struct neighborhood *nb, double weight)
+{
+    unsigned c, i, k, good, other;
+    int sx, sy, dot;
+    double share, total, toward, away, sum;
+
+    for (c = 0; c < 9; ++c)
     {
-        int *dpz, *dpnz;
-        if (dx == 0)
+        sx = c / 3 - 1;
+        sy = c % 3 - 1;
+
+        good = 0;
+        for (i = 0; i < nb->size; ++i)
+            if (nb->dirs[i][0] * sx + nb->dirs[i][1] * sy > 0)
+                nb->order[c][good++] = i;
+        other = good;
+        for (i = 0; i < nb->size; ++i)
         {
-            dpz = &dx;
-            dpnz = &dy;
+            dot = nb->dirs[i][0] * sx + nb->dirs[i][1] * sy;
+            if (dot <= 0)
+                nb->order[c][other++] = i;
         }
+        other = nb->size - good;
+
+        share = (double)good / nb->size;
+        if (weight <= 0.5)
+            total = 2 * weight * share;
         else
+            total = share + (2 * weight - 1) * (1 - share);
+        if (total > 1 || !other)
+            total = 1;
+        if (total < 0 || !good)
+            total = 0;
+        toward = good ? total / good : 0;
+        away = other ? (1 - total) / other : 0;
+
+        sum = 0;
+        for (k = 0; k + 1 < nb->size; ++k)
         {
-            dpz = &dy;
-            dpnz = &dx;
+            sum += k < good ? toward : away;
+            nb->thresholds[c][k] = chance_threshold(sum);
         }
+    }
 
-        if (r >= (weight * 0.5))
-        {
-            r -= weight * 0.5;
-            if (r < weight * (1.0 / 6) + (1 - weight) * (1.0 / 3))
-            {
-                *dpz = -1;
-                *dpnz = 0;
-            }
-            else if (r < weight * (2.0 / 6) + (1 - weight) * (2.0 / 3))
-            {
-                *dpz = 1;
-                *dpnz = 0;
-            }
-            else
-            {
-                *dpz = 0;
-                *dpnz *= -1;
-            }
-        }
+    nb->weight = weight;
+}
+
+static void neighborhood_step(struct drunkard *drunk, struct neighborhood *nb,
+    double weight)
+{
+    int dx = drunkard_get_dx_to_target(drunk);
+    int dy = drunkard_get_dy_to_target(drunk);
+    unsigned c, k, i;
+    uint32_t r;
+    const int *dir;
+
+    if (!nb->size)
+        return;
+    r = rng_u32(drunk->rng);
+    if (weight != nb->weight)
+        neighborhood_table(nb, weight);
+
+    c = ((dx > 0) - (dx < 0) + 1) * 3 + (dy > 0) - (dy < 0) + 1;
+    if (c == 4)
+        return;
+
+    k = 0;
+    for (i = 0; i + 1 < nb->size; ++i)
+        k += r >= nb->thresholds[c][i];
+
+    dir = nb->dirs[nb->order[c][k]];
+    drunkard_step_by(drunk, dir[0], dir[1]);
+}
+
+/* Sets nb to the n steps in dirs, allocating it if need be. */
+static bool neighborhood_set(struct neighborhood **nb, const int (*dirs)[2],
+    unsigned n)
+{
+    if (!*nb)
+    {
+        *nb = malloc(sizeof **nb);
+        if (!*nb)
+            return false;
     }
-    else
+
+    memcpy((*nb)->dirs, dirs, sizeof *dirs * n);
+    (*nb)->size = n;
+    (*nb)->weight = -1;
+    return true;
+}
+
+bool drunkard_step_to_target_8(struct drunkard *drunk, double weight)
+{
+    if (!drunk->eight && !neighborhood_set(&drunk->eight, eight_dirs, 8))
+        return false;
+    neighborhood_step(drunk, drunk->eight, weight);
+    return true;
+}
+
+bool drunkard_set_neighborhood(struct drunkard *drunk, const int (*dirs)[2],
+    unsigned n)
+{
+    if (n > DRUNKARD_NEIGHBORHOOD_MAX)
+        return false;
+
+    return neighborhood_set(&drunk->custom, dirs, n);
+}
+
+void drunkard_step_to_target_custom(struct drunkard *drunk, double weight)
+{
+    if (drunk->custom)
+        neighborhood_step(drunk, drunk->custom, weight);
+}
+
+/* Same as looping mark brush, check drunkard_is_on_opened, step to target,
+ * but with the tile and bounds work done once. While every cell the brush
+ * covers is in bounds (which is almost always) marking and stepping skip
+ * IN_BOUNDS entirely.
+ */
+unsigned drunkard_walk_to_opened(struct drunkard *drunk, double weight,
+    enum drunkard_brush brush, unsigned tile, unsigned max_steps,
+    unsigned *carved)
+{
+    const int (*cells)[2] = brushes[brush];
+    unsigned size = brush_sizes[brush];
+    unsigned steps = 0, marks = 0, i;
+    int dx, dy;
+    /* Region where the whole brush, and any single step (which reaches no
+     * further than a brush), stay in bounds. Same test as mark_brush.
+     */
+    int x0 = drunk->left + BRUSH_REACH, x1 = drunk->right - BRUSH_REACH;
+    int y0 = drunk->top + BRUSH_REACH, y1 = drunk->bot - BRUSH_REACH;
+    bool opens;
+
+    tile &= drunk->tile_mask;
+    opens = tile >= drunk->open_threshold;
+
+    while (steps < max_steps)
     {
-        if (r < weight * 0.5)
-        {
-            dy = 0;
-        }
-        else if (r < weight)
-        {
-            dx = 0;
-        }
-        else if (r < weight + (1 - weight) * 0.5)
+        if (drunk->x >= x0 && drunk->x <= x1 &&
+            drunk->y >= y0 && drunk->y <= y1)
         {
-            dx *= -1;
-            dy = 0;
+            if (pointset_has(drunk->openedset, make_point(drunk->x, drunk->y)))
+                break;
+
+            for (i = 0; i < size; ++i)
+                mark_unchecked(drunk, drunk->x + cells[i][0],
+                    drunk->y + cells[i][1], tile, opens);
+            marks += size;
+
+            choose_step(drunk, weight, &dx, &dy);
+            drunk->x += dx;
+            drunk->y += dy;
         }
         else
         {
-            dx = 0;
-            dy *= -1;
+            if (IN_BOUNDS(drunk, drunk->x, drunk->y) &&
+                drunkard_is_on_opened(drunk))
+                break;
+
+            marks += mark_brush(drunk, drunk->x, drunk->y, brush, tile, opens);
+
+            drunkard_step_to_target(drunk, weight);
         }
+
+        steps++;
     }
 
-    drunkard_step_by(drunk, dx, dy);
+    if (carved)
+        *carved = marks;
+    return steps;
 }
 
 struct line_path_struct
@@ -1034,6 +3206,183 @@ void drunkard_tunnel_path_to_target(struct drunkard *drunk)
     drunk->pathing_function = tunnel_path;
 }
 
+struct cost_path_struct
+{
+    unsigned next;
+};
+
+static bool cost_path(struct drunkard *drunk)
+{
+    struct cost_path_struct *data = (void *)drunk->path_data;
+    unsigned cell;
+
+    if (data->next == drunk->arena->path_length)
+        return false;
+
+    cell = drunk->arena->path[data->next++];
+    drunk->x = cell % drunk->width;
+    drunk->y = cell / drunk->width;
+    return true;
+}
+
+static const int cost_dirs[4][2] = {{-1, 0}, {0, -1}, {0, 1}, {1, 0}};
+
+/* Path costs stop at ~0u rather than wrapping. */
+static unsigned cost_add(unsigned a, unsigned b)
+{
+    return a > ~0u - b ? ~0u : a + b;
+}
+
+/* A* over the four directions, where stepping onto a cell costs what
+ * cell_costs (or tile_costs, by the tile on it) says and 0 can't be
+ * entered. When stopping at opened tiles there's more than one goal, so the
+ * heuristic is dropped and it's plain Dijkstra.
+ */
+static bool cost_search(struct drunkard *drunk, const unsigned *cell_costs,
+    const unsigned *tile_costs, unsigned ntiles, bool stop_at_opened)
+{
+    struct path_arena *arena;
+    struct heap_node node;
+    unsigned start, goal, cell, next, g, cost, sum, tile, i, search;
+    int x, y, nx, ny, hx, hy;
+    bool found = false;
+    const uint8_t *tiles8 = NULL;
+    const uint16_t *tiles16 = NULL;
+    const unsigned *tiles32 = NULL;
+
+    if (!IN_BOUNDS(drunk, drunk->x, drunk->y))
+        return false;
+    if (!stop_at_opened && !IN_BOUNDS(drunk, drunk->target_x, drunk->target_y))
+        return false;
+
+    if (!drunk->arena)
+    {
+        drunk->arena = path_arena_create(drunk->width * drunk->height);
+        if (!drunk->arena)
+            return false;
+    }
+    arena = drunk->arena;
+
+    if (++arena->search == 0)
+    {
+        memset(arena->stamp, 0, sizeof *arena->stamp * drunk->width * drunk->height);
+        arena->search = 1;
+    }
+    search = arena->search;
+
+    switch (drunk->tile_size)
+    {
+    case DRUNKARD_TILE_8:
+        tiles8 = drunk->tiles;
+        break;
+    case DRUNKARD_TILE_16:
+        tiles16 = drunk->tiles;
+        break;
+    case DRUNKARD_TILE_32:
+        tiles32 = drunk->tiles;
+        break;
+    }
+
+    start = TILE_INDEX(drunk, drunk->x, drunk->y);
+    goal = start;
+    arena->heap_length = 0;
+    arena->stamp[start] = search;
+    arena->cost[start] = 0;
+    if (!heap_push(arena, 0, start))
+        return false;
+
+    while (arena->heap_length)
+    {
+        node = heap_pop(arena);
+        cell = node.cell;
+        x = cell % drunk->width;
+        y = cell / drunk->width;
+        g = arena->cost[cell];
+
+        hx = stop_at_opened ? 0 : abs(drunk->target_x - x);
+        hy = stop_at_opened ? 0 : abs(drunk->target_y - y);
+        if (node.f > cost_add(g, hx + hy))
+            continue;
+
+        if ((x == drunk->target_x && y == drunk->target_y) ||
+            (stop_at_opened && cell != start &&
+             pointset_has(drunk->openedset, make_point(x, y))))
+        {
+            goal = cell;
+            found = true;
+            break;
+        }
+
+        for (i = 0; i < 4; ++i)
+        {
+            nx = x + cost_dirs[i][0];
+            ny = y + cost_dirs[i][1];
+            if (!IN_BOUNDS(drunk, nx, ny))
+                continue;
+
+            next = TILE_INDEX(drunk, nx, ny);
+            if (cell_costs)
+            {
+                cost = cell_costs[next];
+            }
+            else
+            {
+                tile = tiles8 ? tiles8[next] :
+                    tiles16 ? tiles16[next] : tiles32[next];
+                cost = tile < ntiles ? tile_costs[tile] : 0;
+            }
+            if (!cost)
+                continue;
+
+            sum = cost_add(g, cost);
+            if (arena->stamp[next] != search || sum < arena->cost[next])
+            {
+                arena->stamp[next] = search;
+                arena->cost[next] = sum;
+                arena->from[next] = i;
+                hx = stop_at_opened ? 0 : abs(drunk->target_x - nx);
+                hy = stop_at_opened ? 0 : abs(drunk->target_y - ny);
+                if (!heap_push(arena, cost_add(sum, hx + hy), next))
+                    return false;
+            }
+        }
+    }
+
+    if (!found)
+        return false;
+
+    /* Walk back from the goal, then reverse into walking order. */
+    arena->path_length = 0;
+    for (cell = goal; cell != start; )
+    {
+        arena->path[arena->path_length++] = cell;
+        i = arena->from[cell];
+        cell -= cost_dirs[i][1] * (int)drunk->width + cost_dirs[i][0];
+    }
+    for (i = 0; i < arena->path_length / 2; ++i)
+    {
+        cell = arena->path[i];
+        arena->path[i] = arena->path[arena->path_length - 1 - i];
+        arena->path[arena->path_length - 1 - i] = cell;
+    }
+
+    ((struct cost_path_struct *)(void *)drunk->path_data)->next = 0;
+    drunk->pathing_function = cost_path;
+    return true;
+}
+
+bool drunkard_cost_path_to_target(struct drunkard *drunk,
+    const unsigned *costs, bool stop_at_opened)
+{
+    return cost_search(drunk, costs, NULL, 0, stop_at_opened);
+}
+
+bool drunkard_tile_cost_path_to_target(struct drunkard *drunk,
+    const unsigned *costs, unsigned ntiles, bool stop_at_opened)
+{
+    return cost_search(drunk, NULL, costs, ntiles, stop_at_opened);
+}
+
 bool drunkard_walk_path(struct drunkard *drunk)
 {
     if (drunk->pathing_function)
@@ -1056,6 +3405,491 @@ void drunkard_cancel_path(struct drunkard *drunk)
     drunk->pathing_function = NULL;
 }
 
+/* Adds x0..x1 on row y, joining the last span when they touch. */
+static void span_add(struct drunkard_span *spans, unsigned *n, int y, int x0,
+    int x1)
+{
+    struct drunkard_span *last = *n ? &spans[*n - 1] : NULL;
+
+    if (last && last->y == y && x0 <= last->x1 + 1 && x1 >= last->x0 - 1)
+    {
+        if (x0 < last->x0)
+            last->x0 = x0;
+        if (x1 > last->x1)
+            last->x1 = x1;
+        return;
+    }
+
+    spans[*n].y = y;
+    spans[*n].x0 = x0;
+    spans[*n].x1 = x1;
+    (*n)++;
+}
+
+/* Walks the horizontal leg of a tunnel in one go, finding where it runs into
+ * an opened tile by scanning the row's words. Returns true if it did.
+ */
+static bool tunnel_run(struct drunkard *drunk, struct drunkard_span *spans,
+    unsigned *n)
+{
+    struct tunnel_path_struct *data = (void *)drunk->path_data;
+    int step = drunk->target_x < drunk->x ? -1 : 1;
+    int from = drunk->x + step, to = drunk->target_x;
+    int lo = step > 0 ? from : to, hi = step > 0 ? to : from;
+    int hit = -1;
+
+    if (lo < drunk->left)
+        lo = drunk->left;
+    if (hi > drunk->right)
+        hi = drunk->right;
+    if (drunk->y >= drunk->top && drunk->y <= drunk->bot && lo <= hi)
+    {
+        if (step > 0)
+            hit = pointset_first_in_row(drunk->openedset, drunk->y, lo, hi);
+        else
+            hit = pointset_last_in_row(drunk->openedset, drunk->y, lo, hi);
+    }
+
+    if (hit != from)
+    {
+        int end = hit >= 0 ? hit - step : to;
+        span_add(spans, n, drunk->y, step > 0 ? from : end, step > 0 ? end : from);
+    }
+
+    drunk->x = hit >= 0 ? hit : to;
+    if (drunk->x == to)
+    {
+        data->first = data->second;
+        data->second = NONE;
+    }
+
+    return hit >= 0;
+}
+
+unsigned drunkard_walk_path_spans(struct drunkard *drunk,
+    struct drunkard_span *spans, unsigned max_spans)
+{
+    struct tunnel_path_struct *tunnel = (void *)drunk->path_data;
+    unsigned n = 0;
+
+    while (drunk->pathing_function && n < max_spans)
+    {
+        if (drunk->pathing_function == tunnel_path &&
+            tunnel->first == HORIZONTAL && drunk->x != drunk->target_x)
+        {
+            if (tunnel_run(drunk, spans, &n))
+            {
+                drunkard_cancel_path(drunk);
+                break;
+            }
+            continue;
+        }
+
+        if (!drunk->pathing_function(drunk))
+        {
+            /* Like the walk_path loop, which gets one more pass here. */
+            drunkard_cancel_path(drunk);
+            if (!IN_BOUNDS(drunk, drunk->x, drunk->y) ||
+                !drunkard_is_on_opened(drunk))
+                span_add(spans, &n, drunk->y, drunk->x, drunk->x);
+            break;
+        }
+
+        if (IN_BOUNDS(drunk, drunk->x, drunk->y) && drunkard_is_on_opened(drunk))
+        {
+            drunkard_cancel_path(drunk);
+            break;
+        }
+        span_add(spans, &n, drunk->y, drunk->x, drunk->x);
+    }
+
+    return n;
+}
+
+/******************************************************************************\
+Walker pools.
+\******************************************************************************/
+
+/* Positions and targets are kept as separate arrays, and only the first
+ * active walkers are still walking, so each pass of the lockstep walk is a
+ * flat loop over ints. Walkers draw from their own four lane generator,
+ * seeded from the drunkard's RNG when they're started, so r is refilled a
+ * whole xoshiro_x4_step block at a time.
+ */
+struct drunkard_pool
+{
+    struct drunkard *drunk;
+    unsigned size;
+    unsigned active;
+
+    int *x, *y;
+    int *target_x, *target_y;
+    uint32_t *r;
+    uint64_t lanes[4][RNG_LANES];
+};
+
+enum {POOL_BLOCK = 2 * RNG_LANES};
+
+struct drunkard_pool *drunkard_pool_create(struct drunkard *drunk, unsigned size)
+{
+    /* r is filled whole blocks at a time. */
+    unsigned blocks = (size + POOL_BLOCK - 1) / POOL_BLOCK;
+    struct drunkard_pool *pool = malloc(sizeof *pool);
+    if (!pool)
+        goto alloc_failure;
+
+    memset(pool, 0, sizeof *pool);
+    pool->drunk = drunk;
+    pool->size = size;
+
+    /* An empty pool is valid and never walks; malloc(0) may return NULL. */
+    if (size == 0)
+        return pool;
+
+    pool->x = malloc(sizeof *pool->x * size);
+    pool->y = malloc(sizeof *pool->y * size);
+    pool->target_x = malloc(sizeof *pool->target_x * size);
+    pool->target_y = malloc(sizeof *pool->target_y * size);
+    pool->r = malloc(sizeof *pool->r * POOL_BLOCK * blocks);
+    if (!pool->x || !pool->y || !pool->target_x || !pool->target_y || !pool->r)
+        goto alloc_failure;
+
+    return pool;
+
+alloc_failure:
+    drunkard_pool_destroy(pool);
+    return NULL;
+}
+
+void drunkard_pool_destroy(struct drunkard_pool *pool)
+{
+    if (pool)
+    {
+        free(pool->x);
+        free(pool->y);
+        free(pool->target_x);
+        free(pool->target_y);
+        free(pool->r);
+        free(pool);
+    }
+}
+
+void drunkard_pool_start_random(struct drunkard_pool *pool)
+{
+    struct drunkard *drunk = pool->drunk;
+    int x = drunk->x, y = drunk->y;
+    int target_x = drunk->target_x, target_y = drunk->target_y;
+    uint64_t seed;
+    unsigned i;
+
+    for (i = 0; i < pool->size; ++i)
+    {
+        drunkard_start_random(drunk);
+        drunkard_target_random_opened(drunk);
+        pool->x[i] = drunk->x;
+        pool->y[i] = drunk->y;
+        pool->target_x[i] = drunk->target_x;
+        pool->target_y[i] = drunk->target_y;
+    }
+    pool->active = pool->size;
+
+    /* Seeded like rng_seed, so no lane starts all zero. */
+    seed = (uint64_t)rng_u32(drunk->rng) << 32 | rng_u32(drunk->rng);
+    for (i = 0; i < 4 * RNG_LANES; ++i)
+        pool->lanes[i % 4][i / 4] = splitmix64(&seed);
+
+    drunk->x = x;
+    drunk->y = y;
+    drunk->target_x = target_x;
+    drunk->target_y = target_y;
+}
+
+/* Retires walkers standing on opened tiles by swapping in the last active
+ * one. Walkers never leave the map, so no bounds check. Returns how many
+ * were retired.
+ */
+static unsigned pool_retire(struct drunkard_pool *pool)
+{
+    struct drunkard *drunk = pool->drunk;
+    unsigned retired = 0, i = 0, n;
+    int x, y;
+
+    while (i < pool->active)
+    {
+        if (pointset_has(drunk->openedset, make_point(pool->x[i], pool->y[i])))
+        {
+            n = --pool->active;
+            x = pool->x[i];
+            pool->x[i] = pool->x[n];
+            pool->x[n] = x;
+            y = pool->y[i];
+            pool->y[i] = pool->y[n];
+            pool->y[n] = y;
+            x = pool->target_x[i];
+            pool->target_x[i] = pool->target_x[n];
+            pool->target_x[n] = x;
+            y = pool->target_y[i];
+            pool->target_y[i] = pool->target_y[n];
+            pool->target_y[n] = y;
+            retired++;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    return retired;
+}
+
+/* Steps the first n walkers once, as choose_step would but on the top 31
+ * bits of each draw, so the thresholds (at most 2^31) and the compares all
+ * fit in 32 bit lanes. The step is worked out from the signs instead of
+ * looked up in step_dirs: on an axis the four choices are towards, the two
+ * sides and away; off the axes they're x towards, y towards, x away and
+ * y away. Nothing here branches or gathers, so the loop vectorizes.
+ */
+static void pool_step(struct drunkard_pool *pool, unsigned n)
+{
+    struct drunkard *drunk = pool->drunk;
+    uint32_t thresholds[2][3];
+    int *px = pool->x, *py = pool->y;
+    const int *ptx = pool->target_x, *pty = pool->target_y;
+    const uint32_t *pr = pool->r;
+    int left = drunk->left, right = drunk->right;
+    int top = drunk->top, bot = drunk->bot;
+    int x, y, sx, sy, on, k, s, ends, odd, dx, dy, nx, ny, move;
+    uint32_t r, t0, t1, t2;
+    unsigned i, j;
+
+    /* ceil(c * 2^31) from ceil(c * 2^32). */
+    for (i = 0; i < 2; ++i)
+        for (j = 0; j < 3; ++j)
+            thresholds[i][j] = (uint32_t)((drunk->step_thresholds[i][j] + 1) >> 1);
+
+    for (i = 0; i < n; i += POOL_BLOCK)
+        xoshiro_x4_step(pool->lanes, &pool->r[i]);
+
+    for (i = 0; i < n; ++i)
+    {
+        x = px[i];
+        y = py[i];
+        sx = (ptx[i] > x) - (ptx[i] < x);
+        sy = (pty[i] > y) - (pty[i] < y);
+        on = (sx == 0) | (sy == 0);
+
+        r = pr[i] >> 1;
+        t0 = on ? thresholds[STEP_ON_AXIS][0] : thresholds[STEP_OFF_AXIS][0];
+        t1 = on ? thresholds[STEP_ON_AXIS][1] : thresholds[STEP_OFF_AXIS][1];
+        t2 = on ? thresholds[STEP_ON_AXIS][2] : thresholds[STEP_OFF_AXIS][2];
+        k = (r >= t0) + (r >= t1) + (r >= t2);
+
+        /* s is 1 for the first two choices and -1 for the last two. */
+        s = 1 - (k & 2);
+        odd = k & 1;
+        ends = odd == k >> 1;
+        if (on)
+        {
+            dx = ends ? s * sx : -s * sy * sy;
+            dy = ends ? s * sy : -s * sx * sx;
+        }
+        else
+        {
+            dx = odd ? 0 : s * sx;
+            dy = odd ? s * sy : 0;
+        }
+
+        nx = x + dx;
+        ny = y + dy;
+        move = nx >= left && nx <= right && ny >= top && ny <= bot;
+        px[i] = move ? nx : x;
+        py[i] = move ? ny : y;
+    }
+}
+
+unsigned drunkard_pool_walk_to_opened(struct drunkard_pool *pool, double weight,
+    enum drunkard_brush brush, unsigned tile, unsigned max_steps)
+{
+    struct drunkard *drunk = pool->drunk;
+    unsigned reached = 0, steps, i, n;
+    bool opens;
+
+    tile &= drunk->tile_mask;
+    opens = tile >= drunk->open_threshold;
+
+    if (weight != drunk->step_weight)
+        step_table(drunk, weight);
+
+    for (steps = 0; steps < max_steps && pool->active; ++steps)
+    {
+        reached += pool_retire(pool);
+
+        n = pool->active;
+
+        for (i = 0; i < n; ++i)
+            mark_brush(drunk, pool->x[i], pool->y[i], brush, tile, opens);
+
+        pool_step(pool, n);
+    }
+
+    /* Count the walkers the last step brought onto an opened tile. */
+    return reached + pool_retire(pool);
+}
+
+/******************************************************************************\
+State snapshots.
+\******************************************************************************/
+
+/* Pathing functions are saved by their position in this table. */
+static bool (*const pathing_functions[]) (struct drunkard *) =
+{
+    NULL,
+    line_path,
+    tunnel_path,
+    cost_path
+};
+enum {COST_PATH_FUNCTION = 3};
+
+enum {PATHING_FUNCTIONS = sizeof pathing_functions / sizeof *pathing_functions};
+
+struct state_header
+{
+    uint32_t size;
+    uint32_t rng_type;
+    uint32_t seed;
+    uint32_t stream;
+    int32_t x, y;
+    int32_t target_x, target_y;
+    uint32_t pathing_function;
+    unsigned char path_data[256];
+    /* Cells left on a cost path, stored after the generator. */
+    uint32_t path_cells;
+};
+
+/* The cells of the cost path being walked that haven't been walked yet. */
+static unsigned cost_path_left(struct drunkard *drunk)
+{
+    struct cost_path_struct *data = (void *)drunk->path_data;
+
+    if (drunk->pathing_function != cost_path)
+        return 0;
+    return drunk->arena->path_length - data->next;
+}
+
+unsigned drunkard_state_size(struct drunkard *drunk)
+{
+    return sizeof(struct state_header) + rng_state_size(drunk->rng->type) +
+        sizeof(uint32_t) * cost_path_left(drunk);
+}
+
+void drunkard_save_state(struct drunkard *drunk, void *buf)
+{
+    struct state_header header;
+    unsigned char *cells;
+    unsigned i;
+    uint32_t cell;
+
+    for (i = 0; i < PATHING_FUNCTIONS; ++i)
+        if (pathing_functions[i] == drunk->pathing_function)
+            break;
+
+    memset(&header, 0, sizeof header);
+    header.size = drunkard_state_size(drunk);
+    header.rng_type = drunk->rng->type;
+    header.seed = drunk->seed;
+    header.stream = drunk->stream;
+    header.x = drunk->x;
+    header.y = drunk->y;
+    header.target_x = drunk->target_x;
+    header.target_y = drunk->target_y;
+    header.pathing_function = i;
+    memcpy(header.path_data, drunk->path_data, sizeof header.path_data);
+    header.path_cells = cost_path_left(drunk);
+
+    memcpy(buf, &header, sizeof header);
+    rng_save(drunk->rng, (unsigned char *)buf + sizeof header);
+
+    /* A cost path lives in the arena rather than path_data, so what's left
+     * of it goes after the generator.
+     */
+    cells = (unsigned char *)buf + sizeof header +
+        rng_state_size(drunk->rng->type);
+    for (i = 0; i < header.path_cells; ++i)
+    {
+        cell = drunk->arena->path[drunk->arena->path_length -
+            header.path_cells + i];
+        memcpy(cells + sizeof cell * i, &cell, sizeof cell);
+    }
+}
+
+bool drunkard_load_state(struct drunkard *drunk, const void *buf)
+{
+    struct state_header header;
+
+    const unsigned char *payload = (const unsigned char *)buf + sizeof header;
+    const unsigned char *cells;
+    struct rng_state st;
+    unsigned i;
+    uint32_t cell;
+
+    /* Everything is checked and the generator loaded on the side first, so
+     * a bad snapshot leaves the drunkard as it was.
+     */
+    memcpy(&header, buf, sizeof header);
+    if (header.pathing_function >= PATHING_FUNCTIONS ||
+        header.rng_type > DRUNKARD_RNG_XOSHIRO256X4 ||
+        header.path_cells > drunk->width * drunk->height ||
+        (header.path_cells &&
+         header.pathing_function != COST_PATH_FUNCTION) ||
+        header.size != sizeof header + rng_state_size(header.rng_type) +
+            sizeof cell * header.path_cells ||
+        !rng_check(payload))
+        return false;
+
+    cells = payload + rng_state_size(header.rng_type);
+    for (i = 0; i < header.path_cells; ++i)
+    {
+        memcpy(&cell, cells + sizeof cell * i, sizeof cell);
+        if (cell >= drunk->width * drunk->height)
+            return false;
+    }
+
+    if (header.pathing_function == COST_PATH_FUNCTION && !drunk->arena)
+    {
+        drunk->arena = path_arena_create(drunk->width * drunk->height);
+        if (!drunk->arena)
+            return false;
+    }
+
+    if (!rng_init(&st, header.rng_type))
+        return false;
+    rng_load(&st, payload);
+    rng_uninit(drunk->rng);
+    *drunk->rng = st;
+
+    drunk->seed = header.seed;
+    drunk->stream = header.stream;
+    drunk->x = header.x;
+    drunk->y = header.y;
+    drunk->target_x = header.target_x;
+    drunk->target_y = header.target_y;
+    drunk->pathing_function = pathing_functions[header.pathing_function];
+    memcpy(drunk->path_data, header.path_data, sizeof header.path_data);
+
+    if (header.pathing_function == COST_PATH_FUNCTION)
+    {
+        for (i = 0; i < header.path_cells; ++i)
+        {
+            memcpy(&cell, cells + sizeof cell * i, sizeof cell);
+            drunk->arena->path[i] = cell;
+        }
+        drunk->arena->path_length = header.path_cells;
+        ((struct cost_path_struct *)(void *)drunk->path_data)->next = 0;
+    }
+
+    return true;
+}
+
 /******************************************************************************\
 Checking functions.
 \******************************************************************************/
@@ -1072,27 +3906,30 @@ bool drunkard_is_on_marked(struct drunkard *drunk)
 
 bool drunkard_is_opened_on_rect(struct drunkard *drunk, unsigned hw, unsigned hh)
 {
-    int x, y;
-    for (x = ceil(drunk->x - hw) - 1; x <= floor(drunk->x + hw) + 1; ++x)
-        for (y = ceil(drunk->y - hh) - 1; y <= floor(drunk->y + hh) + 1; ++y)
-            if (!IN_BOUNDS(drunk, x, y) || drunkard_is_opened(drunk, x, y))
-                return true;
-    return false;
+    int x0 = drunk->x - (int)hw - 1, x1 = drunk->x + (int)hw + 1;
+    int y0 = drunk->y - (int)hh - 1, y1 = drunk->y + (int)hh + 1;
+
+    if (x0 < drunk->left || x1 > drunk->right ||
+        y0 < drunk->top || y1 > drunk->bot)
+        return true;
+    return pointset_any_on_rect(drunk->openedset, x0, y0, x1, y1);
 }
 
 bool drunkard_is_opened_on_circle(struct drunkard *drunk, unsigned r)
 {
-    int dx, dy, h, x, y;
-    for (dx = -(int)r; dx <= (int)r; ++dx)
+    const int *widths = circle_widths(drunk, r);
+    int dy, h, y;
+
+    for (dy = -(int)r; dy <= (int)r; ++dy)
     {
-        h = floor(sqrt(r * r - dx * dx));
-        for (dy = -h; dy <= h; ++dy)
-        {
-            x = drunkard_get_x(drunk) + dx;
-            y = drunkard_get_y(drunk) + dy;
-            if (!IN_BOUNDS(drunk, x, y) || drunkard_is_opened(drunk, x, y))
-                return true;
-        }
+        h = circle_width(widths, r, dy);
+        y = drunk->y + dy;
+        if (y < drunk->top || y > drunk->bot ||
+            drunk->x - h < drunk->left || drunk->x + h > drunk->right)
+            return true;
+        if (pointset_first_in_row(drunk->openedset, y, drunk->x - h,
+            drunk->x + h) >= 0)
+            return true;
     }
 
     return false;
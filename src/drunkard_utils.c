@@ -78,19 +78,17 @@ struct drunkard_generic_args
 
 static int carve_shrinking_square(struct drunkard *drunk, int min, int max, unsigned tile)
 {
-    bool has_opened;
+    /* The largest room of half size n whose box, n + 2 out, is clear. */
+    int fits = (int)drunkard_distance_to_opened(drunk,
+        drunkard_get_x(drunk), drunkard_get_y(drunk)) - 3;
 
-    do {
-        has_opened = drunkard_is_opened_on_rect(drunk, max + 1, max + 1);
-        max--;
-    } while (has_opened && max >= min);
+    if (fits > max)
+        fits = max;
+    if (fits < min && fits < max)
+        return 0;
 
-    if (!has_opened)
-    {
-        drunkard_mark_rect(drunk, max + 1, max + 1, tile);
-        return max + 1;
-    }
-    return 0;
+    drunkard_mark_rect(drunk, fits, fits, tile);
+    return fits;
 }
 #if 0
 static int carve_shrinking_circle(struct drunkard *drunk, int min, int max, unsigned tile)
@@ -111,27 +109,33 @@ static int carve_shrinking_circle(struct drunkard *drunk, int min, int max, unsi
     return 0;
 }
 #endif
-static void carve_cave(struct drunkard *drunk, void *args)
+static bool carve_cave(struct drunkard *drunk, void *args)
 {
     struct drunkard_generic_args *pargs = args;
 
     drunkard_start_random(drunk);
     drunkard_target_random_opened(drunk);
 
-    while (!drunkard_is_on_opened(drunk))
-    {
-        drunkard_mark_plus(drunk, pargs->floor_tile);
-        drunkard_step_to_target(drunk, pargs->randomness);
-    }
+    drunkard_walk_to_opened(drunk, pargs->randomness, DRUNKARD_BRUSH_PLUS,
+        pargs->floor_tile, ~0u, NULL);
 
     drunkard_flush_marks(drunk);
+    return true;
 }
 
-static void carve_room_then_corridor(struct drunkard *drunk, void *args)
+static bool carve_room_then_corridor(struct drunkard *drunk, void *args)
 {
     struct drunkard_generic_args *pargs = args;
+    unsigned x, y;
 
-    drunkard_start_random(drunk);
+    /* Only start where at least the smallest room fits. Carving only opens
+     * tiles, so once nowhere fits, nowhere will.
+     */
+    if (!drunkard_random_free_rect(drunk, pargs->min_width + 1,
+        pargs->min_width + 1, &x, &y))
+        return false;
+
+    drunkard_start_fixed(drunk, x, y);
     drunkard_target_random_opened(drunk);
 
     int marked = carve_shrinking_square(drunk,
@@ -139,14 +143,18 @@ static void carve_room_then_corridor(struct drunkard *drunk, void *args)
 
     if (marked)
     {
+        struct drunkard_span spans[64];
+        unsigned n;
+
         drunkard_tunnel_path_to_target(drunk);
-        while (drunkard_walk_path(drunk) && !drunkard_is_on_opened(drunk))
-        {
-            drunkard_mark_1(drunk, pargs->floor_tile);
-        }
+        do {
+            n = drunkard_walk_path_spans(drunk, spans, 64);
+            drunkard_mark_spans(drunk, spans, n, pargs->floor_tile);
+        } while (n == 64);
     }
 
     drunkard_flush_marks(drunk);
+    return true;
 }
 
 /******************************************************************************\
@@ -252,6 +260,7 @@ void drunkard_carve_plans(struct drunkard *drunk, struct drunkard_plans *plans)
     while (patt)
     {
         max_weight += patt->weight;
+        patt->done = false;
         patt = patt->prev;
     }
 
@@ -268,12 +277,19 @@ void drunkard_carve_plans(struct drunkard *drunk, struct drunkard_plans *plans)
         r = drunkard_rng_range(drunk, 1, max_weight);
 
         patt = plans->patterns;
-        while (r - (int)patt->weight > 0)
+        while (patt->done || r - (int)patt->weight > 0)
         {
-            r -= patt->weight;
+            if (!patt->done)
+                r -= patt->weight;
             patt = patt->prev;
         }
 
-        patt->pattern_func(drunk, patt->args);
+        if (!patt->pattern_func(drunk, patt->args))
+        {
+            patt->done = true;
+            max_weight -= patt->weight;
+            if (!max_weight)
+                break;
+        }
     }
 }